@@ -0,0 +1,308 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "lua_include.h"
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <new>
+
+namespace cglb {
+
+
+/**
+ * Counters kept by a state_allocator. bytes is what Lua asked for, not counting
+ * the rounding up to a size class.
+ */
+struct allocator_stats
+{
+    allocator_stats() :
+        bytes(0), blocks(0), peak_bytes(0), limit_failures(0)
+    {
+    }
+
+    size_t bytes;           //bytes in use
+    size_t blocks;          //blocks in use
+    size_t peak_bytes;      //most bytes in use at once
+    size_t limit_failures;  //allocations refused because of the limit
+};
+
+
+/**
+ * An optional lua_Alloc for one lua_State. Small blocks are served from free lists
+ * of 16 byte size classes, which covers what the bindings make the most of: the
+ * object userdata, closures with one or two upvalues, and small tables. Larger
+ * blocks go to realloc/free.
+ *
+ * It also keeps allocator_stats for the state, and can refuse to grow the state past
+ * a limit, which makes the allocation raise a Lua memory error.
+ *
+ * Usage:
+ *
+ *   cglb::state_allocator alloc;
+ *   lua_State* L = alloc.newstate();
+ *   ...
+ *   lua_close(L); //before alloc is destroyed
+ *
+ * Like the lua_State, it is not thread safe. Memory from the free lists is kept
+ * until the allocator is destroyed, so it must outlive the state.
+ */
+class state_allocator
+{
+public:
+    /**
+     * Called when an allocation would go past the limit, with the bytes in use and
+     * the size of the allocation. Return true to let the allocation through anyway,
+     * for example after raising the limit with set_limit.
+     */
+    typedef bool (*limit_hook)(state_allocator& allocator, size_t in_use, size_t requested, void* userdata);
+
+    explicit state_allocator(size_t limit = 0) :
+        limit_bytes(limit), hook(nullptr), hook_userdata(nullptr)
+    {
+        for(size_t i = 0; i < class_count; ++i)
+        {
+            free_lists[i] = nullptr;
+        }
+    }
+
+    ~state_allocator()
+    {
+        for(void* chunk : chunks)
+        {
+            std::free(chunk);
+        }
+    }
+
+    /**
+     * Makes a new lua_State which uses this allocator, with the same panic function
+     * as luaL_newstate. Returns NULL if the state could not be made, which is also
+     * the case for LuaJIT builds on x64 without GC64, since those do not allow a
+     * custom allocator.
+     */
+    lua_State* newstate()
+    {
+        lua_State* L = lua_newstate(&state_allocator::alloc,this);
+        if(L != NULL)
+            lua_atpanic(L,&state_allocator::panic);
+        return L;
+    }
+
+    /**
+     * A limit of 0 means no limit. The limit only stops the state from growing, so a
+     * state already over it keeps working, and can still shrink.
+     */
+    void set_limit(size_t bytes, limit_hook fn = nullptr, void* userdata = nullptr)
+    {
+        limit_bytes = bytes;
+        hook = fn;
+        hook_userdata = userdata;
+    }
+
+    size_t limit() const
+    {
+        return limit_bytes;
+    }
+
+    allocator_stats const& stats() const
+    {
+        return counters;
+    }
+
+    /**
+     * The lua_Alloc. ud is the state_allocator.
+     */
+    static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+    {
+        state_allocator* self = static_cast<state_allocator*>(ud);
+        //From 5.2 on, osize is the type of the object when ptr is NULL
+        if(ptr == NULL)
+            osize = 0;
+
+        if(nsize == 0)
+        {
+            if(ptr != NULL)
+                self->release(ptr,osize);
+            return NULL;
+        }
+
+        if(nsize > osize && !self->may_grow(nsize - osize))
+            return NULL;
+
+        //stays in the same block
+        if(ptr != NULL && fits_in_place(osize,nsize))
+        {
+            self->counters.bytes = self->counters.bytes - osize + nsize;
+            self->update_peak();
+            return ptr;
+        }
+
+        //both large blocks, let realloc move it
+        if(ptr != NULL && size_class(osize) == class_count && size_class(nsize) == class_count)
+        {
+            void* block = std::realloc(ptr,nsize);
+            if(block == NULL)
+                return nsize <= osize ? self->shrink_in_place(ptr,osize,nsize) : NULL;
+            self->counters.bytes = self->counters.bytes - osize + nsize;
+            self->update_peak();
+            return block;
+        }
+
+        void* block = self->acquire(nsize);
+        if(block == NULL)
+            return (ptr != NULL && nsize <= osize) ? self->shrink_in_place(ptr,osize,nsize) : NULL;
+        if(ptr != NULL)
+        {
+            std::memcpy(block,ptr,osize < nsize ? osize : nsize);
+            self->release(ptr,osize);
+        }
+        return block;
+    }
+
+private:
+    static const size_t class_granularity = 16;
+    static const size_t class_count = 16;          //so blocks up to 256 bytes are pooled
+    static const size_t chunk_size = 16 * 1024;
+
+    struct free_block
+    {
+        free_block* next;
+    };
+
+    //class_count for blocks which are too large for the free lists
+    static size_t size_class(size_t size)
+    {
+        size_t c = (size + class_granularity - 1) / class_granularity;
+        return (c == 0 || c > class_count) ? class_count : c - 1;
+    }
+
+    static bool fits_in_place(size_t osize, size_t nsize)
+    {
+        size_t c = size_class(osize);
+        return c != class_count && c == size_class(nsize);
+    }
+
+    bool may_grow(size_t extra)
+    {
+        if(limit_bytes == 0 || counters.bytes + extra <= limit_bytes)
+            return true;
+        if(hook != nullptr && hook(*this,counters.bytes,extra,hook_userdata))
+            return true;
+        ++counters.limit_failures;
+        return false;
+    }
+
+    /**
+     * Lua expects a shrink to never fail, so when there is no block for nsize the old one
+     * is kept. It is released later as a block of nsize, which it is large enough for; a
+     * malloc'd block which ends up in a free list that way is freed with the chunks.
+     */
+    void* shrink_in_place(void* ptr, size_t osize, size_t nsize)
+    {
+        if(size_class(osize) == class_count && size_class(nsize) != class_count)
+        {
+            try
+            {
+                chunks.push_back(ptr);
+            }
+            catch(std::bad_alloc&)
+            {
+                //only leaked, it is still usable
+            }
+        }
+        counters.bytes = counters.bytes - osize + nsize;
+        return ptr;
+    }
+
+    void update_peak()
+    {
+        if(counters.bytes > counters.peak_bytes)
+            counters.peak_bytes = counters.bytes;
+    }
+
+    void* acquire(size_t size)
+    {
+        size_t c = size_class(size);
+        void* block = NULL;
+        if(c == class_count)
+        {
+            block = std::malloc(size);
+        }
+        else
+        {
+            if(free_lists[c] == nullptr)
+                grow(c);
+            block = free_lists[c];
+            if(block != NULL)
+                free_lists[c] = free_lists[c]->next;
+        }
+        if(block == NULL)
+            return NULL;
+        counters.bytes += size;
+        ++counters.blocks;
+        update_peak();
+        return block;
+    }
+
+    void release(void* ptr, size_t size)
+    {
+        size_t c = size_class(size);
+        if(c == class_count)
+        {
+            std::free(ptr);
+        }
+        else
+        {
+            free_block* block = static_cast<free_block*>(ptr);
+            block->next = free_lists[c];
+            free_lists[c] = block;
+        }
+        counters.bytes -= size;
+        --counters.blocks;
+    }
+
+    //carves a chunk in to blocks of size class c
+    void grow(size_t c)
+    {
+        size_t block_size = (c + 1) * class_granularity;
+        char* chunk = static_cast<char*>(std::malloc(chunk_size));
+        if(chunk == NULL)
+            return;
+        try
+        {
+            chunks.push_back(chunk);
+        }
+        catch(std::bad_alloc&)
+        {
+            std::free(chunk);
+            return;
+        }
+        for(size_t offset = 0; offset + block_size <= chunk_size; offset += block_size)
+        {
+            free_block* block = reinterpret_cast<free_block*>(chunk + offset);
+            block->next = free_lists[c];
+            free_lists[c] = block;
+        }
+    }
+
+    static int panic(lua_State* L)
+    {
+        fprintf(stderr,"PANIC: unprotected error in call to Lua API (%s)\n",lua_tostring(L,-1));
+        return 0;
+    }
+
+    free_block* free_lists[class_count];
+    std::vector<void*> chunks;
+    allocator_stats counters;
+    size_t limit_bytes;
+    limit_hook hook;
+    void* hook_userdata;
+
+    state_allocator(state_allocator const&);
+    state_allocator& operator=(state_allocator const&);
+};
+
+}
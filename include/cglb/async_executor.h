@@ -0,0 +1,200 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "lua_include.h"
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <cstddef>
+
+namespace cglb {
+
+
+/**
+ * A call which returned something to wait for (see detail::await_task in
+ * luafn_interop.h), and the coroutine which yielded until it is ready.
+ */
+class async_task
+{
+public:
+    async_task() : thread(nullptr), thread_ref(LUA_NOREF), owner(nullptr), waiting(false)
+    {
+    }
+
+    virtual ~async_task()
+    {
+    }
+
+    /**
+     * Returns true once the results of the call are there, or if the coroutine is not
+     * waiting any more
+     */
+    virtual bool ready() = 0;
+
+    /**
+     * Resumes the coroutine, and returns the status of lua_resume. The call which yielded
+     * gets its results itself, and yields again if it was not ready after all. On an
+     * error, the message is left on top of the stack of thread for the executor, and
+     * anything else the coroutine returned or yielded is popped.
+     *
+     * A task which is not waiting (the coroutine failed to yield, or the call already
+     * returned after the coroutine was resumed by a script) is only released.
+     */
+    int resume()
+    {
+        if(!waiting)
+        {
+            release();
+            return 0;
+        }
+        lua_State* co = thread;
+#if LUA_VERSION_NUM >= 504
+        int nres = 0;
+        int status = lua_resume(co,nullptr,0,&nres);
+#elif LUA_VERSION_NUM >= 502
+        int status = lua_resume(co,nullptr,0);
+#else
+        int status = lua_resume(co,0);
+#endif
+        if(status == 0 || status == LUA_YIELD)
+            lua_settop(co,0);
+        release();
+        return status;
+    }
+
+    /**
+     * Lets the coroutine be collected, for a task which is dropped without being resumed
+     */
+    virtual void release()
+    {
+        if(thread_ref == LUA_NOREF)
+            return;
+        luaL_unref(thread,LUA_REGISTRYINDEX,thread_ref);
+        thread_ref = LUA_NOREF;
+    }
+
+    lua_State* thread;      //the coroutine which is waiting
+    int thread_ref;         //keeps the coroutine from being collected while it waits
+    const void* owner;      //the state_context of the lua_State, see async_executor::cancel
+    bool waiting;           //the coroutine is suspended in the call
+};
+
+
+
+/**
+ * What resumes the coroutines which yielded in a call that returned a std::future (or
+ * std::shared_future). Set for a lua_State with set_executor, and called from the thread
+ * which runs that lua_State, so it needs no locking of its own.
+ */
+class async_executor
+{
+public:
+    virtual ~async_executor()
+    {
+    }
+
+    /**
+     * Takes the task of a coroutine which is about to yield. The coroutine must be
+     * resumed with task->resume() once task->ready() is true, and not before the
+     * lua_CFunction which submitted it has returned.
+     */
+    virtual void submit(std::unique_ptr<async_task> task) = 0;
+
+    /**
+     * Drops every task of owner without resuming it, calling task->release() for each.
+     * Called by set_executor when the executor is replaced, and by lua_close (from a __gc
+     * metamethod, while the registry is still there), so nothing else may be done with
+     * the lua_State of the tasks.
+     */
+    virtual void cancel(const void* owner) = 0;
+};
+
+
+
+/**
+ * An async_executor which is driven by the loop of the program: run_ready resumes every
+ * coroutine whose call has finished, and returns right away otherwise.
+ *
+ * A coroutine which fails is given to the hook (with the message on top of its stack),
+ * if there is one.
+ */
+class local_executor : public async_executor
+{
+public:
+    typedef void (*error_hook)(lua_State* co, void* userdata);
+
+    local_executor(error_hook hook = nullptr, void* userdata = nullptr) :
+        on_error(hook), on_error_data(userdata)
+    {
+    }
+
+    void submit(std::unique_ptr<async_task> task) override
+    {
+        tasks.push_back(std::move(task));
+    }
+
+    void cancel(const void* owner) override
+    {
+        tasks.erase(std::remove_if(tasks.begin(),tasks.end(),
+            [owner](const std::unique_ptr<async_task>& task)
+            {
+                if(task->owner != owner)
+                    return false;
+                task->release();
+                return true;
+            }),
+            tasks.end());
+    }
+
+    /**
+     * Resumes every coroutine whose call is ready, and returns how many were resumed. A
+     * coroutine which yields on another call is submitted again, and is only looked at by
+     * the next run_ready. Tasks whose coroutine was not waiting are only released, and
+     * are not counted.
+     */
+    size_t run_ready()
+    {
+        //taken out first, since resuming submits new tasks
+        std::vector<std::unique_ptr<async_task>> ready;
+        for(auto& task : tasks)
+        {
+            if(task->ready())
+                ready.push_back(std::move(task));
+        }
+        tasks.erase(std::remove(tasks.begin(),tasks.end(),nullptr),tasks.end());
+
+        size_t resumed = 0;
+        for(auto& task : ready)
+        {
+            lua_State* co = task->thread;
+            if(task->waiting)
+                ++resumed;
+            int status = task->resume();
+            if(status != 0 && status != LUA_YIELD)
+            {
+                if(on_error != nullptr)
+                    on_error(co,on_error_data);
+                lua_settop(co,0);
+            }
+        }
+        return resumed;
+    }
+
+    /**
+     * The number of coroutines which are waiting
+     */
+    size_t pending() const
+    {
+        return tasks.size();
+    }
+
+private:
+    std::vector<std::unique_ptr<async_task>> tasks;
+    error_hook on_error;
+    void* on_error_data;
+};
+
+}
@@ -14,3 +14,20 @@
  */
 //#define CGLB_GENERATE_BINDING_DOC
 #define CGLB_BINDING_DOC_FILENAME "cglb_binding_doc.txt"
+
+
+/**
+ * Lua 5.1 and LuaJIT numbers are doubles, which cannot hold every 64 bit integer.
+ * When this is 1, 64 bit integers which a lua_Number cannot hold exactly are pushed
+ * as decimal strings, and function arguments and member data of 64 bit integer types
+ * accept those strings, so values like ids and hashes make the round trip through
+ * Lua unchanged. When it is 0, pushing one raises a Lua error, and so does passing a
+ * number past that range (+-2^53 for a double) for one, so they are never rounded.
+ *
+ * Lua 5.3 and later have 64 bit integers of their own, so this does nothing for them.
+ *
+ * Defaults to 0.
+ */
+#ifndef CGLB_INT64_AS_STRING
+#define CGLB_INT64_AS_STRING 0
+#endif
@@ -8,14 +8,18 @@
 #include "function_def.h"
 #include "class_luarep.h"
 #include "memdat_def.h"
+#include "field_def.h"
+#include "overload_def.h"
 #include "lua_include.h"
-#include "policy/return_gc.h"
+#include "policy/policy.h"
 #include "cglb_init.h"
 #include <vector>
 #include <string>
 #include <type_traits>
 #include <mutex>
 #include <unordered_map>
+#include <algorithm>
+#include <typeinfo>
 #ifdef CGLB_GENERATE_BINDING_DOC
 #include <typeinfo>
 #include <fstream>
@@ -96,37 +100,64 @@ struct class_luadef
     
     static void DeallocateLuaDefs()
     {
+        std::lock_guard<std::mutex> lock(registry_mutex);
         for(auto fnpair : registered_functions)
         {
             free(fnpair.second);
             registered_functions[fnpair.first] = nullptr;
         }
-        class_luarep<T>::DeallocateDeleter();
         registered_functions.clear();
     }
 
     
 
+    /**
+     * Makes <T> have every member of ParentClassT which <T> does not define itself, and
+     * records the cast from <T> to ParentClassT. ParentClassT must be defined first,
+     * and must be a non-virtual base of <T> (a virtual base is a compile error).
+     *
+     * The members are copied in to the metatable of <T>, so a lookup on <T> costs the
+     * same no matter how deep the hierarchy is. Members added to ParentClassT (or its
+     * own parents) later are copied down as well, unless <T> has its own member of the
+     * same name. A member defined by <T> is never replaced by inherit, before or after.
+     */
     template<typename ParentClassT>
     class_luadef& inherit()
     {
+        CheckNotSealed();
+        detail::type_context* ptc = class_luarep<ParentClassT>::context(L);
+        if(ptc == nullptr)
+        {
+            luaL_error(L,"No metatable for the parent of %s in this lua_State",name);
+            return *this;
+        }
+        //so that class_luarep<ParentClassT>::check accepts a T
+        detail::type_record::add_base<T,ParentClassT>();
+
+        //so that members added to the parent later get to T
+        unsigned id = detail::type_id<T>::get();
+        if(std::find(ptc->derived.begin(),ptc->derived.end(),id) == ptc->derived.end())
+            ptc->derived.push_back(id);
+
         int top = lua_gettop(L);
-        luaL_getmetatable(L,class_luarep<ParentClassT>::mt_name.c_str());
+        class_luarep<ParentClassT>::push_metatable(L);     //[1] = parent metatable
         int parent_mtbl = lua_gettop(L);
-        luaL_getmetatable(L,class_luarep<T>::mt_name.c_str());
+        class_luarep<T>::push_metatable(L);                 //[2] = metatable
         int mtbl = lua_gettop(L);
-        lua_pushnil(L);
-        while(lua_next(L,parent_mtbl) != 0)
+        lua_pushnil(L);                                     //[3] = nil
+        while(lua_next(L,parent_mtbl) != 0)                 //[3] = key, [4] = value
         {
             int keyindex = lua_gettop(L) - 1;
-            if(lua_isstring(L,keyindex))
-            {
-                lua_setfield(L,mtbl,lua_tostring(L,keyindex));
-            }
-            else
+            if(lua_type(L,keyindex) == LUA_TSTRING && !detail::is_own_metamethod(lua_tostring(L,keyindex)))
             {
-                lua_pop(L,1);
+                lua_pushvalue(L,keyindex);                  //[5] = key
+                lua_rawget(L,mtbl);                         //[5] = [2][key]
+                bool defined = !lua_isnil(L,-1);
+                lua_pop(L,1);                               //pop[5]
+                if(!defined)
+                    SetMember(lua_tostring(L,keyindex),keyindex + 1);
             }
+            lua_pop(L,1);                                   //pop[4]
         }
         lua_settop(L,top);
         return *this;
@@ -154,33 +185,378 @@ struct class_luadef
     class_luadef& >::type
     add(const char* fname, Func f)
     {
-        GenDoc<Func>(class_luarep<T>::class_name, "function", fname);
-        typedef policy<return_gc<std::false_type>> pol;
+        return add<policy_return_nogc>(fname,f);
+    }
+
+
+    /**
+     * Same as add(fname, f), with the policy Pol for the calls of f. For example,
+     * add<policy_unchecked_args>("Step",&T::Step) reads the arguments of Step without
+     * checking their types (see policy/unchecked_args.h), for functions which are
+     * called often and only from trusted scripts.
+     */
+    template< typename Pol, typename Func, typename Traits = function_traits<Func> >
+    typename std::enable_if<
+                ((std::is_pointer<Func>::value
+             && !std::is_member_object_pointer<Func>::value) 
+              || std::is_member_function_pointer<Func>::value)
+              && is_policy<Pol>::value,
+    class_luadef& >::type
+    add(const char* fname, Func f)
+    {
+        GenDoc<Func>(name, "function", fname);
+        typedef Pol pol;
+        CheckNotSealed();
 
         //setup for closure
-        auto mtn = class_luarep<T>::mt_name;
-        luaL_getmetatable(L,mtn.c_str());               //[1] = metatable
+        class_luarep<T>::push_metatable(L);             //[1] = metatable
         if(lua_isnoneornil(L,-1))
         {
-            luaL_error(L,"No metatable named %s. Global %s returned %s",mtn.c_str()
-                , mtn.c_str(), luaL_typename(L,-1));
+            luaL_error(L,"No metatable for %s in this lua_State",name);
             return *this;
         }
         int mtidx = lua_gettop(L); 
-        
-        lua_pushstring(L,fname);
 
-        PushFunctionClosure<Func,pol>(fname,f);
-        lua_settable(L,mtidx);
+        PushFunctionClosure<Func,pol>(f);
+        SetMember(fname,-1);
 
-        lua_pop(L,1); //pop metatable
+        lua_settop(L,mtidx-1); //pop metatable and closure
 
         return *this;
     }
 
+
+    /**
+     * Add a lambda or std::function (or any other callable class) as a member function of
+     * <T>. Its captures are stored in the closure itself, see callable_def in
+     * function_def.h, and destroyed with the closure. Like a non-member function pointer,
+     * the object is its first argument when called with the colon (:) operator:
+     *
+     *     .add("Scaled",[factor](T* self, float v) { return self->x * factor * v; })
+     */
+    template< typename Func >
+    typename std::enable_if< std::is_class<Func>::value,
+    class_luadef& >::type
+    add(const char* fname, Func f)
+    {
+        return add<policy_return_nogc>(fname,std::move(f));
+    }
+
+
+    /**
+     * Same as add(fname, f) for callables, with the policy Pol for the calls of f
+     */
+    template< typename Pol, typename Func >
+    typename std::enable_if< std::is_class<Func>::value && is_policy<Pol>::value,
+    class_luadef& >::type
+    add(const char* fname, Func f)
+    {
+        GenDoc<Func>(name, "function", fname);
+        CheckNotSealed();
+
+        class_luarep<T>::push_metatable(L);             //[1] = metatable
+        if(lua_isnoneornil(L,-1))
+        {
+            luaL_error(L,"No metatable for %s in this lua_State",name);
+            return *this;
+        }
+        int mtidx = lua_gettop(L);
+
+        callable_def<function_traits<Func>,Func,Pol>::Push(L,std::move(f));   //[2] = closure
+        SetMember(fname,-1);
+
+        lua_settop(L,mtidx-1); //pop metatable and closure
+        return *this;
+    }
+
+
+    /**
+     * Adds several functions under one name, for overloaded C++ functions (which have to
+     * be cast to the overload they are, like static_cast<int (T::*)(int)>(&T::Get)). A
+     * call picks the function from the number and the Lua types of its arguments, see
+     * overload_def.h. Functions which take the lua_State* themselves are only picked when
+     * none of the others fit.
+     */
+    template< typename Func1, typename Func2, typename... Funcs >
+    typename std::enable_if<
+                ((std::is_pointer<Func1>::value
+             && !std::is_member_object_pointer<Func1>::value) 
+              || std::is_member_function_pointer<Func1>::value)
+             && ((std::is_pointer<Func2>::value
+             && !std::is_member_object_pointer<Func2>::value) 
+              || std::is_member_function_pointer<Func2>::value),
+    class_luadef& >::type
+    add(const char* fname, Func1 f1, Func2 f2, Funcs... fs)
+    {
+        return add<policy_return_nogc>(fname,f1,f2,fs...);
+    }
+
+
+    /**
+     * Same as add(fname, f1, f2, ...), with the policy Pol for the calls of every function
+     */
+    template< typename Pol, typename Func1, typename Func2, typename... Funcs >
+    typename std::enable_if<
+                ((std::is_pointer<Func1>::value
+             && !std::is_member_object_pointer<Func1>::value) 
+              || std::is_member_function_pointer<Func1>::value)
+             && ((std::is_pointer<Func2>::value
+             && !std::is_member_object_pointer<Func2>::value) 
+              || std::is_member_function_pointer<Func2>::value)
+             && is_policy<Pol>::value,
+    class_luadef& >::type
+    add(const char* fname, Func1 f1, Func2 f2, Funcs... fs)
+    {
+        CheckNotSealed();
+        class_luarep<T>::push_metatable(L);             //[1] = metatable
+        if(lua_isnoneornil(L,-1))
+        {
+            luaL_error(L,"No metatable for %s in this lua_State",name);
+            return *this;
+        }
+        int mtidx = lua_gettop(L);
+
+        typedef int expand[];
+        (void)expand{ 0, (GenDoc<Func1>(name, "function", fname),0), (GenDoc<Func2>(name, "function", fname),0),
+                      (GenDoc<Funcs>(name, "function", fname),0)... };
+
+        overload_def* od = MakeOverloadDef<Pol>(fname,f1,f2,fs...);
+        lua_pushlightuserdata(L,od);                    //[2] = od
+        lua_pushcclosure(L,&overload_def::LuaFunction,1);   //[2] = closure
+        //the Lua side of a call which may wait expects every overload to return that way
+        static_assert(count_awaitable<Func1,Func2,Funcs...>::value == 0
+                   || count_awaitable<Func1,Func2,Funcs...>::value == 2 + sizeof...(Funcs),
+            "Overloads which return a future can't be mixed with ones which don't");
+        if(count_awaitable<Func1,Func2,Funcs...>::value != 0)
+            detail::WrapAwaitClosure(L);                //[2] = wrapper
+        SetMember(fname,-1);
+
+        lua_settop(L,mtidx-1); //pop metatable and closure
+        return *this;
+    }
+
 //helper functions for add(function)
 private:
 
+    //how many of Funcs return a future
+    template< typename... Funcs >
+    struct count_awaitable : public std::integral_constant<size_t,0>
+    {
+    };
+
+    template< typename Func, typename... Funcs >
+    struct count_awaitable<Func,Funcs...> : public std::integral_constant<size_t,
+        (detail::is_awaitable<typename std::decay<typename function_traits<Func>::result_type>::type>::value ? 1 : 0)
+      + count_awaitable<Funcs...>::value>
+    {
+    };
+
+
+    /**
+     * The def made for a function by MakeFunctionDef, along with how to call it
+     */
+    struct function_entry
+    {
+        void* def;
+        lua_CFunction lua_function;  //takes def as upvalue 1
+        detail::accessor_fn invoke;  //takes def as an argument
+    };
+
+
+    /**
+     * Returns the overload_def in registered_functions for exactly these functions under
+     * fname, or makes and fills in one. A def is never changed once it is made, since
+     * other lua_States may be calling it.
+     */
+    template< typename pol, typename... Funcs >
+    overload_def* MakeOverloadDef(const char* fname, Funcs... fs)
+    {
+        //prefixed, so that it is not mistaken for the def of a single function, and the
+        //name ends at the '\0' so that it can be used as overload_def::name
+        static const std::string prefix = "overloads:";
+        std::string key = prefix + fname;
+        key.push_back('\0');
+        key.append(typeid(pol).name());
+        AppendOverloadKey(key,fs...);
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            auto itr = registered_functions.find(key);
+            if(itr != registered_functions.end())
+                return (overload_def*)(itr->second);
+        }
+
+        //filled in without the lock, since MakeFunctionDef takes it
+        const size_t count = sizeof...(Funcs);
+        const int max_nargs = detail::max_overload_nargs<Funcs...>::value;
+        overload_def* od = (overload_def*)malloc(overload_def::bytes_for(count,max_nargs));
+        od->count = count;
+        AddOverloads<pol>(od,0,fs...);
+        od->finish(max_nargs);
+
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        auto inserted = registered_functions.insert(std::pair<std::string,void*>(key,(void*)od));
+        if(!inserted.second)
+        {
+            //made by another thread in the meantime
+            free(od);
+            return (overload_def*)(inserted.first->second);
+        }
+        od->name = inserted.first->first.c_str() + prefix.size();
+        return od;
+    }
+
+
+    template< typename Func, typename... Funcs >
+    static void AppendOverloadKey(std::string& key, Func f, Funcs... fs)
+    {
+        key.append(typeid(Func).name());
+        key.append(reinterpret_cast<const char*>(&f),sizeof(f));
+        AppendOverloadKey(key,fs...);
+    }
+
+    static void AppendOverloadKey(std::string&)
+    {
+    }
+
+
+    /**
+     * Fills entry i onwards of od with the functions. Each function gets its own def,
+     * the same one it would have been added with alone.
+     */
+    template< typename pol, typename Func, typename... Funcs >
+    void AddOverloads(overload_def* od, size_t i, Func f, Funcs... fs)
+    {
+        function_entry entry = MakeFunctionDef<Func,pol>(f);
+        detail::overload_entry& oe = od->entries[i];
+        oe.score = detail::overload_score<Func,function_traits<Func>>();
+        oe.invoke = entry.invoke;
+        oe.def = entry.def;
+        oe.nargs = detail::overload_nargs<Func>::value;
+        oe.first_arg = std::is_member_function_pointer<Func>::value ? 2 : 1;
+        oe.first_types = detail::overload_first_arg<Func,function_traits<Func>>::types();
+        AddOverloads<pol>(od,i + 1,fs...);
+    }
+
+    template< typename pol >
+    void AddOverloads(overload_def*, size_t)
+    {
+    }
+
+
+    /**
+     * Pushes a closure which calls f
+     */
+    template< typename Func, typename pol >
+    void PushFunctionClosure(Func f)
+    {
+        function_entry entry = MakeFunctionDef<Func,pol>(f);
+        lua_pushlightuserdata(L,entry.def);
+        lua_pushcclosure(L,entry.lua_function,1);
+        detail::WrapAwaitable<typename function_traits<Func>::result_type>(L);
+    }
+
+
+    /**
+     * Sets the getter and/or the setter (whichever are not nullptr) of dname in the metatable
+     * of <T>, so that __index and __newindex can call them with a single lookup. See
+     * member_accessor.
+     *
+     * An accessor which is already there for dname (from the other half of the member, or
+     * from inherit) is copied rather than changed, since the parent type may share it.
+     *
+     * Returns the accessor, which is kept alive by the metatable.
+     */
+    detail::member_accessor* SetAccessor(const char* dname,
+                                         detail::accessor_fn get, void* get_def,
+                                         detail::accessor_fn set, void* set_def)
+    {
+        CheckNotSealed();
+        class_luarep<T>::push_metatable(L);             //[1] = metatable
+        int mtidx = lua_gettop(L);
+        if(lua_isnoneornil(L,mtidx))
+        {
+            luaL_error(L,"No metatable for %s in this lua_State",name);
+            return nullptr;
+        }
+        lua_pushstring(L,dname);                        //[2] = dname
+        lua_rawget(L,mtidx);                            //[2] = [1][dname]
+        detail::member_accessor* existing = lua_type(L,-1) == LUA_TUSERDATA
+            ? static_cast<detail::member_accessor*>(lua_touserdata(L,-1)) : nullptr;
+
+        detail::member_accessor* accessor = PushAccessor();    //[3] = accessor
+        if(existing != nullptr)
+        {
+            *accessor = *existing;
+            //fields are their own def
+            if(accessor->get_def == existing)
+                accessor->get_def = accessor;
+            if(accessor->set_def == existing)
+                accessor->set_def = accessor;
+        }
+        if(get != nullptr)
+        {
+            accessor->get = get;
+            accessor->get_def = get_def;
+        }
+        if(set != nullptr)
+        {
+            accessor->set = set;
+            accessor->set_def = set_def;
+        }
+        SetMember(dname,-1);                            //[1][dname] = [3]
+        lua_settop(L,mtidx-1);                          //pop[3,2,1]
+        return accessor;
+    }
+
+
+    /**
+     * Pushes a new member_accessor with nothing set in it
+     */
+    detail::member_accessor* PushAccessor()
+    {
+        detail::member_accessor* accessor = static_cast<detail::member_accessor*>(
+            lua_newuserdata(L,sizeof(detail::member_accessor)));
+        accessor->get = nullptr;
+        accessor->get_def = nullptr;
+        accessor->set = nullptr;
+        accessor->set_def = nullptr;
+        accessor->offset = 0;
+        accessor->field = detail::field_none;
+        return accessor;
+    }
+
+
+    /**
+     * If the type of memdat is a field_type, then adds it as a field, which is read and
+     * written by offset with the field_def of its class, with the accessor itself as the
+     * def. There is no memdat_def and no closure for it.
+     *
+     * Returns false if memdat is not a field_type, and nothing was added.
+     */
+    template< typename MemDatPtr, typename Traits = memdat_traits<MemDatPtr> >
+    bool AddField(const char* dname, MemDatPtr memdat, bool readable, bool writable)
+    {
+        typedef typename Traits::owner_type OwnerT;
+        const unsigned char type = detail::field_type_of<typename Traits::data_type>::value;
+        if(type == detail::field_none)
+            return false;
+
+        AddOwnerCast<OwnerT>();
+        detail::member_accessor* accessor = SetAccessor(dname,
+            readable ? &detail::field_def<OwnerT>::Get : nullptr, nullptr,
+            writable ? &detail::field_def<OwnerT>::Set : nullptr, nullptr);
+        if(accessor == nullptr)
+            return true;
+        if(readable)
+            accessor->get_def = accessor;
+        if(writable)
+            accessor->set_def = accessor;
+        accessor->offset = detail::field_offset(memdat);
+        accessor->field = type;
+        return true;
+    }
+
+
     /**
      * If the function passed in has a lua_State* as the first parameter, then we can assume
      * that the function wishes to manipulate the Lua stack itself rather than have the code
@@ -194,29 +570,17 @@ private:
                                 typename std::integral_constant<size_t, 0            >::type,
                                 typename std::integral_constant<size_t, Traits::arity>::type
                              >::value,
-    void>::type
-    PushFunctionClosure(const char* fn_name, Func f, 
+    function_entry>::type
+    MakeFunctionDef(Func f, 
         typename std::enable_if< 
             std::is_same< typename Traits::template arg<0>::type, lua_State* >::value 
         >::type* = 0)
     {
         typedef custom_function_def<T,pol,Func> CustomFnT;
-        CustomFnT* fndef = nullptr;
-
-        auto itr = registered_functions.find(fn_name);
-        if(itr != registered_functions.end())
-        {
-            fndef = (CustomFnT*)(itr->second);
-        }
-        else
-        {
-            fndef = (CustomFnT*)malloc(sizeof(CustomFnT));
-            fndef->SetFnPtr(f);
-            registered_functions.insert(std::pair<std::string,void*>(fn_name,(void*)fndef));
-        }
+        CustomFnT* fndef = FindOrMakeDef<CustomFnT>(f,[f](CustomFnT* def) { def->SetFnPtr(f); });
         
-        lua_pushlightuserdata(L,(void*)fndef);
-        lua_pushcclosure(L,&CustomFnT::LuaFunction,1);
+        function_entry entry = { (void*)fndef, &CustomFnT::LuaFunction, &CustomFnT::Invoke };
+        return entry;
     }
 
 
@@ -231,29 +595,17 @@ private:
                                 typename std::integral_constant<size_t, 0            >::type,
                                 typename std::integral_constant<size_t, Traits::arity>::type
                              >::value,
-    void>::type
-    PushFunctionClosure(const char* fn_name, Func f, 
+    function_entry>::type
+    MakeFunctionDef(Func f, 
         typename std::enable_if< 
             !std::is_same< typename Traits::template arg<0>::type, lua_State* >::value 
         >::type* = 0)
     {
         typedef function_def<Traits,Func,pol> FnDefT;
-        FnDefT* fndef = nullptr;
-
-        auto itr = registered_functions.find(fn_name);
-        if(itr != registered_functions.end())
-        {
-            fndef = (FnDefT*)(itr->second);
-        }
-        else
-        {
-            fndef = (FnDefT*)malloc(sizeof(FnDefT));
-            fndef->fnptr = f;
-            registered_functions.insert(std::pair<std::string,void*>(fn_name,(void*)fndef));
-        }
+        FnDefT* fndef = FindOrMakeDef<FnDefT>(f,[f](FnDefT* def) { def->fnptr = f; });
         
-        lua_pushlightuserdata(L,(void*)fndef);
-        lua_pushcclosure(L,&FnDefT::LuaFunction,1);
+        function_entry entry = { (void*)fndef, &FnDefT::LuaFunction, &FnDefT::Invoke };
+        return entry;
     }
    
 
@@ -263,26 +615,15 @@ private:
      */
     template< typename Func, typename pol, typename Traits = function_traits<Func> >
     typename std::enable_if< std::is_member_function_pointer<Func>::value,
-    void >::type
-    PushFunctionClosure(const char* fn_name, Func f, typename std::enable_if<true>::type* = 0)
+    function_entry >::type
+    MakeFunctionDef(Func f, typename std::enable_if<true>::type* = 0)
     {
+        AddOwnerCast<typename std::decay<typename Traits::owner_type>::type>();
         typedef function_def<Traits,Func,pol> FnDefT;
-        FnDefT* fndef = nullptr;
+        FnDefT* fndef = FindOrMakeDef<FnDefT>(f,[f](FnDefT* def) { def->fnptr = f; });
 
-        auto itr = registered_functions.find(fn_name);
-        if(itr != registered_functions.end())
-        {
-            fndef = (FnDefT*)(itr->second);
-        }
-        else
-        {
-            fndef = (FnDefT*)malloc(sizeof(FnDefT));
-            fndef->fnptr = f;
-            registered_functions.insert(std::pair<std::string,void*>(fn_name,(void*)fndef));
-        }
-
-        lua_pushlightuserdata(L,(void*)fndef);
-        lua_pushcclosure(L,&FnDefT::LuaFunction,1);
+        function_entry entry = { (void*)fndef, &FnDefT::LuaFunction, &FnDefT::Invoke };
+        return entry;
     }
 
 
@@ -293,46 +634,91 @@ private:
      * Will either retrieve a previously allocated object, or allocate a new one
      */
     template< typename MemDatPtr, typename Traits = memdat_traits<MemDatPtr> >
-    memdat_def<MemDatPtr,Traits>* GetMemDatFunction(const char* dname, MemDatPtr memdat)
+    memdat_def<MemDatPtr,Traits>* GetMemDatFunction(MemDatPtr memdat)
     {
+        AddOwnerCast<typename Traits::owner_type>();
         typedef memdat_def<MemDatPtr,Traits> MemDatT;
+        return FindOrMakeDef<MemDatT>(memdat,[memdat](MemDatT* def) { def->memptr = memdat; });
+    }
 
-        auto itr = registered_functions.find(dname);
+
+    /**
+     * A member which is declared in a base of <T> (&T::Get, where Get is a member of Base)
+     * is called on a Base*, which class_luarep<Base>::check gets from the userdata. Records
+     * the cast from <T> to Base like inherit<Base> does, so that the member works on <T>
+     * without Base being defined itself. There is no cast to a virtual Base, so its
+     * members only work on <T> if Base is defined and <T> is pushed as a Base.
+     */
+    template< typename OwnerT >
+    static typename std::enable_if< detail::is_offset_base<OwnerT,T>::value && !std::is_same<OwnerT,T>::value >::type
+    AddOwnerCast()
+    {
+        detail::type_record::add_base<T,OwnerT>();
+    }
+
+    template< typename OwnerT >
+    static typename std::enable_if< !detail::is_offset_base<OwnerT,T>::value || std::is_same<OwnerT,T>::value >::type
+    AddOwnerCast()
+    {
+    }
+
+
+    /**
+     * Returns the def of type DefT for ptr (a function or member data pointer) in
+     * registered_functions, or mallocs one and has init fill it in. The key is the type of
+     * the def and the bytes of ptr, so a def is only shared (by every lua_State, and every
+     * name) when it is for the very same function, and states which bind different functions
+     * under one name never share a def.
+     *
+     * Locked, since lua_States on other threads may be defining types at the same time.
+     */
+    template< typename DefT, typename PtrT, typename InitFn >
+    static DefT* FindOrMakeDef(PtrT ptr, InitFn init)
+    {
+        std::string key = typeid(DefT).name();
+        key.append(reinterpret_cast<const char*>(&ptr),sizeof(ptr));
+
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        auto itr = registered_functions.find(key);
         if(itr != registered_functions.end())
-        {
-            return (MemDatT*)(itr->second);
-        }
-        else
-        {
-            MemDatT* mdef = (MemDatT*)malloc(sizeof(MemDatT));
-            mdef->memptr = memdat;
-            registered_functions.insert(std::pair<std::string,void*>(dname,(void*)mdef));
-            return mdef;
-        }
+            return (DefT*)(itr->second);
+
+        DefT* def = (DefT*)malloc(sizeof(DefT));
+        init(def);
+        registered_functions.insert(std::pair<std::string,void*>(key,(void*)def));
+        return def;
     }
 
 
-    //used for getters and setters
-    //returns -1 on error
-    int PushMetaFunctionTable(const char* meta_name)
+    /**
+     * Sets key in the metatable of <T> to the value at validx, and in every type which
+     * inherits the member from <T>. See state_context::set_member.
+     */
+    void SetMember(const char* key, int validx)
     {
-        luaL_getmetatable(L,class_luarep<T>::mt_name.c_str());
-        if(lua_isnoneornil(L,-1))
+        detail::state_context* ctx = detail::state_context::get(L);
+        detail::type_context* tc = class_luarep<T>::context(L);
+        if(ctx == nullptr || tc == nullptr)
         {
-            luaL_error(L,"No metatable named %s",class_luarep<T>::mt_name.c_str());
-            return -1;
+            luaL_error(L,"No metatable for %s in this lua_State",name);
+            return;
         }
-        int mtidx = lua_gettop(L);
-        lua_pushstring(L,meta_name);
-        lua_rawget(L,mtidx);
-        if(lua_isnoneornil(L,-1))
-        {
-            luaL_error(L,"No %s for %s", meta_name, class_luarep<T>::class_name.c_str());
-            return -1;
-        }
-        return lua_gettop(L);
+        ctx->set_member(L,tc,key,validx);
     }
-    
+
+
+    /**
+     * Raises a Lua error if <T> was sealed in L, since the members of a sealed
+     * type cannot change
+     */
+    void CheckNotSealed()
+    {
+        detail::type_context* tc = class_luarep<T>::context(L);
+        if(tc != nullptr && tc->sealed)
+            luaL_error(L,"%s is sealed in this lua_State",name);
+    }
+
+
 public:
 
     /**
@@ -346,59 +732,16 @@ public:
     class_luadef& >::type
     add(const char* dname, MemDatPtr memdat)
     {
-        GenDoc<MemDatPtr>(class_luarep<T>::class_name, "readwrite member data", dname);
+        GenDoc<MemDatPtr>(name, "readwrite member data", dname);
+        if(AddField(dname,memdat,true,true))
+            return *this;
 
         typedef memdat_traits<MemDatPtr> Traits;
         typedef memdat_def<MemDatPtr,Traits> MemDatT;
 
-        luaL_getmetatable(L,class_luarep<T>::mt_name.c_str());
-        if(lua_isnoneornil(L,-1))
-        {
-            luaL_error(L,"No metatable named %s",class_luarep<T>::mt_name.c_str());
-            return *this;
-        }
-        int mtidx = lua_gettop(L);
-
-        lua_pushstring(L,"__cglb_getters");
-        lua_rawget(L,mtidx);
-        if(lua_isnoneornil(L,-1))
-        {
-            luaL_error(L,"No __cglb_getters for %s", class_luarep<T>::class_name.c_str());
-            return *this;
-        }
-        int getteridx = lua_gettop(L);
-
-        
-        auto* md = GetMemDatFunction(dname,memdat);
-        lua_pushlightuserdata(L,(void*)md);
-
-        lua_pushvalue(L,-1);
-        int uval = lua_gettop(L);
-
-        lua_pushstring(L,dname);
-        lua_pushvalue(L,uval);
-        lua_pushcclosure(L,&MemDatT::LuaGetFunction,1);
-        lua_settable(L,getteridx);
-
-
-        lua_pushstring(L,"__cglb_setters");
-        lua_rawget(L,mtidx);
-        if(lua_isnoneornil(L,-1))
-        {
-            luaL_error(L,"No __cglb_setters for %s", class_luarep<T>::class_name.c_str());
-            return *this;
-        }
-        int setteridx = lua_gettop(L);
-
-        lua_pushstring(L,dname);
-        lua_pushvalue(L,uval);
-        lua_pushcclosure(L,&MemDatT::LuaSetFunction,1);
-        lua_settable(L,setteridx);
-
-
-        lua_settop(L,mtidx-1); //clean stack
+        auto* md = GetMemDatFunction(memdat);
+        SetAccessor(dname,&MemDatT::Get,(void*)md,&MemDatT::Set,(void*)md);
         return *this;
-        
     }
 
     /**
@@ -422,22 +765,13 @@ public:
     class_luadef& >::type
     add_read(const char* getter_name, Func f)
     {
-        GenDoc<Func>(class_luarep<T>::class_name, "read", getter_name);
+        static_assert(!detail::is_awaitable<typename std::decay<typename Traits::result_type>::type>::value,
+            "A getter can't return a future, since __index can't yield");
+        GenDoc<Func>(name, "read", getter_name);
         typedef policy<return_gc<std::false_type>> pol;
         
-        int top = lua_gettop(L);
-
-        int getter_idx = PushMetaFunctionTable("__cglb_getters");
-        if(getter_idx == -1)
-        {
-            lua_settop(L,top);
-            return *this;
-        }
-        
-        PushFunctionClosure<Func,pol>(getter_name,f);
-        lua_settable(L,getter_idx);
-
-        lua_settop(L,top);
+        function_entry entry = MakeFunctionDef<Func,pol>(f);
+        SetAccessor(getter_name,entry.invoke,entry.def,nullptr,nullptr);
         return *this;
     }
 
@@ -463,22 +797,15 @@ public:
     class_luadef& >::type
     add_write(const char* setter_name, Func f)
     {
-        GenDoc<Func>(class_luarep<T>::class_name, "write", setter_name);
+        static_assert(!detail::is_awaitable<typename std::decay<typename Traits::result_type>::type>::value,
+            "A setter can't return a future, since __newindex can't yield");
+        GenDoc<Func>(name, "write", setter_name);
         typedef policy<return_gc<std::false_type>> pol;
         
-        int top = lua_gettop(L);
-
-        int setter_idx = PushMetaFunctionTable("__cglb_setters");
-        if(setter_idx == -1)
-        {
-            lua_settop(L,top);
-            return *this;
-        }
-        
-        PushFunctionClosure<Func,pol>(setter_name,f);
-        lua_settable(L,setter_idx);
-
-        lua_settop(L,top);
+        //called with the object at index 1 and the value at index 2,
+        //the same as obj:setter(value)
+        function_entry entry = MakeFunctionDef<Func,pol>(f);
+        SetAccessor(setter_name,nullptr,nullptr,entry.invoke,entry.def);
         return *this;
     }
 
@@ -493,41 +820,15 @@ public:
     class_luadef& >::type
     add_readonly(const char* dname, MemDatPtr memdat)
     {
-        GenDoc<MemDatPtr>(class_luarep<T>::class_name, "readonly member data", dname);
+        GenDoc<MemDatPtr>(name, "readonly member data", dname);
+        if(AddField(dname,memdat,true,false))
+            return *this;
 
         typedef memdat_traits<MemDatPtr> Traits;
         typedef memdat_def<MemDatPtr,Traits> MemDatT;
 
-        luaL_getmetatable(L,class_luarep<T>::mt_name.c_str());
-        if(lua_isnoneornil(L,-1))
-        {
-            luaL_error(L,"No metatable named %s",class_luarep<T>::mt_name.c_str());
-            return *this;
-        }
-        int mtidx = lua_gettop(L);
-
-        lua_pushstring(L,"__cglb_getters");
-        lua_rawget(L,mtidx);
-        if(lua_isnoneornil(L,-1))
-        {
-            luaL_error(L,"No __cglb_getters for %s", class_luarep<T>::class_name.c_str());
-            return *this;
-        }
-        int getteridx = lua_gettop(L);
-
-        
-        auto* md = GetMemDatFunction(dname,memdat);
-        lua_pushlightuserdata(L,(void*)md);
-
-        lua_pushvalue(L,-1);
-        int uval = lua_gettop(L);
-
-        lua_pushstring(L,dname);
-        lua_pushvalue(L,uval);
-        lua_pushcclosure(L,&MemDatT::LuaGetFunction,1);
-        lua_settable(L,getteridx);
-
-        lua_settop(L,mtidx-1);
+        auto* md = GetMemDatFunction(memdat);
+        SetAccessor(dname,&MemDatT::Get,(void*)md,nullptr,nullptr);
         return *this;
     }
 
@@ -542,41 +843,15 @@ public:
     class_luadef& >::type
     add_writeonly(const char* dname, MemDatPtr memdat)
     {
-        GenDoc<MemDatPtr>(class_luarep<T>::class_name, "writeonly member data", dname);
+        GenDoc<MemDatPtr>(name, "writeonly member data", dname);
+        if(AddField(dname,memdat,false,true))
+            return *this;
 
         typedef memdat_traits<MemDatPtr> Traits;
         typedef memdat_def<MemDatPtr,Traits> MemDatT;
 
-        luaL_getmetatable(L,class_luarep<T>::mt_name.c_str());
-        if(lua_isnoneornil(L,-1))
-        {
-            luaL_error(L,"No metatable named %s",class_luarep<T>::mt_name.c_str());
-            return *this;
-        }
-        int mtidx = lua_gettop(L);
-
-        lua_pushstring(L,"__cglb_setters");
-        lua_rawget(L,mtidx);
-        if(lua_isnoneornil(L,-1))
-        {
-            luaL_error(L,"No __cglb_setters for %s", class_luarep<T>::class_name.c_str());
-            return *this;
-        }
-        int setteridx = lua_gettop(L);
-
-        
-        auto* md = GetMemDatFunction(dname,memdat);
-        lua_pushlightuserdata(L,(void*)md);
-
-        lua_pushvalue(L,-1);
-        int uval = lua_gettop(L);
-
-        lua_pushstring(L,dname);
-        lua_pushvalue(L,uval);
-        lua_pushcclosure(L,&MemDatT::LuaSetFunction,1);
-        lua_settable(L,setteridx);
-
-        lua_settop(L,mtidx-1);
+        auto* md = GetMemDatFunction(memdat);
+        SetAccessor(dname,nullptr,nullptr,&MemDatT::Set,(void*)md);
         return *this;
     }
 
@@ -617,30 +892,131 @@ public:
     }
 
     /**
-     * The template parameters are the used to define the argument types passed to the 
+     * Objects of <T> which are made by "constructor" or returned by value from bound functions
+     * will be constructed inside of the Lua userdata rather than being allocated with new and boxed by a pointer.
+     * They are destroyed in place upon garbage collection, so the destructor set with
+     * "destructor" is not used for them.
+     *
+     * Types which need more alignment than Lua gives to userdata are still boxed.
+     *
+     * Like everything else about <T>, this only applies to this lua_State.
+     */
+    class_luadef& store_values_inline(bool enable = true)
+    {
+        class_luarep<T>::context(L)->inline_values = enable;
+        return *this;
+    }
+
+    /**
+     * Objects of <T> which are made by "constructor" or returned by value from bound functions
+     * will be constructed in blocks from a pool which belongs to <T> in this lua_State, rather
+     * than being allocated with new. Blocks go back to the pool upon garbage collection, so
+     * short lived objects do not touch the heap once the pool has grown enough. blocks_per_chunk
+     * is how many blocks the pool allocates at a time.
+     *
+     * Pooled objects are destroyed in place, so the destructor set with "destructor" is not used
+     * for them. store_values_inline takes priority over this for types which can be stored inline.
+     */
+    class_luadef& use_pool(bool enable = true, size_t blocks_per_chunk = 64)
+    {
+        detail::type_context* tc = class_luarep<T>::context(L);
+        if(tc->pool != nullptr)
+        {
+            tc->pool->orphan();
+            tc->pool = nullptr;
+        }
+        if(enable)
+            tc->pool = new detail::storage_pool(sizeof(T),blocks_per_chunk);
+        return *this;
+    }
+
+    /**
+     * Pointers to <T> will be pushed as handles: a slot and a generation in a slot map that
+     * belongs to <T> in this lua_State, rather than the pointer itself. C++ can then delete an
+     * object which Lua still refers to, after calling class_luarep<T>::invalidate for it, and
+     * class_luarep<T>::check will give NULL for the userdata in Lua rather than a dangling pointer.
+     *
+     * Only affects objects pushed after this call. Objects made by emplace with inline or pooled
+     * storage belong to their userdata, and are not handles.
+     */
+    class_luadef& use_handles(bool enable = true)
+    {
+        detail::type_context* tc = class_luarep<T>::context(L);
+        if(tc->handles != nullptr)
+        {
+            tc->handles->orphan();
+            tc->handles = nullptr;
+        }
+        if(enable)
+            tc->handles = new detail::slot_map();
+        return *this;
+    }
+
+    /**
+     * Pushing the same pointer to <T> more than once will push the same userdata, as long as
+     * the first one has not been garbage collected. This keeps repeated pushes from making
+     * garbage, and makes == between them work without an __eq metamethod.
+     *
+     * This is per lua_State, and costs a table lookup on every push of <T> in L.
+     */
+    class_luadef& identity_cache(bool enable = true)
+    {
+        class_luarep<T>::set_identity_cache(L,enable);
+        return *this;
+    }
+
+    /**
+     * What assigning to a key which is not a writable member of <T> does in this lua_State.
+     * The default, unknown_keys_ignore, drops the assignment. unknown_keys_error raises a Lua
+     * error. unknown_keys_property_bag keeps the value in a table for the userdata, which
+     * __index looks in for keys which are not members (members always come first).
+     * unknown_keys_custom calls hook like __newindex, with the object, key and value at
+     * index 1, 2 and 3.
+     *
+     * Property bags are kept by userdata, so with pointers to <T> pushed more than once,
+     * identity_cache is needed for them to share a bag. In Lua 5.1, a bag which refers to
+     * its own userdata keeps it from being collected.
+     */
+    class_luadef& unknown_keys(unknown_key_policy policy, lua_CFunction hook = nullptr)
+    {
+        class_luarep<T>::set_unknown_keys(L,policy,hook);
+        return *this;
+    }
+
+    /**
+     * Freezes the members of <T> in this lua_State, and builds a perfect hash from their
+     * names to the methods and getters, which __index then looks in before the metatable.
+     * Since Lua interns strings, a lookup is a multiply and a pointer compare.
+     *
+     * Call it last, after everything has been added (and after inherit, for a derived type).
+     * Adding anything to <T> in this lua_State afterwards raises a Lua error. Types which
+     * inherit from <T> copy its members as usual, and can be sealed on their own.
+     */
+    class_luadef& seal()
+    {
+        class_luarep<T>::seal(L);
+        return *this;
+    }
+
+    /**
+     * The template parameters are the used to define the argument types passed to the
      * constructor of <T>
      */
     template<typename... Args>
     class_luadef& constructor()
     {
+        CheckNotSealed();
         //need the metatable since we are setting a metafunction
-        luaL_getmetatable(L,class_luarep<T>::mt_name.c_str());
+        class_luarep<T>::push_metatable(L);
         int mtidx = lua_gettop(L);
         
-        typedef function_traits<
-            decltype(&class_luarep<T>::template constructor<Args...>::ConstructType)
-            > Traits;
         typedef decltype(&class_luarep<T>::template constructor<Args...>::ConstructType) FuncT;
-        typedef policy<return_gc<std::true_type>> pol; //Constructor should always delete on GC
-        typedef function_def<Traits,FuncT,pol> FnDefT;
         
-        GenDoc<FuncT>(class_luarep<T>::class_name, "constructor", "constructor");
-
-        auto* fd = (FnDefT*)lua_newuserdata(L,sizeof(FnDefT));
-        fd->fnptr = &class_luarep<T>::template constructor<Args...>::ConstructType;
-
+        GenDoc<FuncT>(name, "constructor", "constructor");
 
-        lua_pushcclosure(L,&FnDefT::LuaFunction,1);
+        //Constructed objects are always garbage collected, and use the allocation
+        //strategy of T (see store_values_inline and use_pool)
+        lua_pushcfunction(L,&(constructor_def<T,Args...>::LuaFunction));
         lua_setfield(L,mtidx,"__init");
         
         lua_getfield(L,mtidx,"__init");
@@ -662,14 +1038,15 @@ public:
     custom_constructor(Func f)
     {
 
-        GenDoc<Func>(class_luarep<T>::class_name, "constructor", "constructor");
+        GenDoc<Func>(name, "constructor", "constructor");
+        CheckNotSealed();
 
         typedef policy<return_gc<std::true_type>> pol;
-        luaL_getmetatable(L,class_luarep<T>::mt_name.c_str());
+        class_luarep<T>::push_metatable(L);
         int mtidx = lua_gettop(L);
-        PushFunctionClosure<Func,pol>("__init",f);
+        PushFunctionClosure<Func,pol>(f);
         lua_setfield(L,mtidx,"__init"); // as a metamethod
-        PushFunctionClosure<Func,pol>(name,f);
+        PushFunctionClosure<Func,pol>(f);
         lua_setglobal(L,name); //and as a more C-like constructor syntax
         
         lua_settop(L,mtidx-1);
@@ -788,12 +1165,13 @@ public:
     template<typename pol, typename FnPtr, typename Traits = function_traits<FnPtr>>
     class_luadef& opMeta(const char* metaname, FnPtr fnptr)
     {
-        GenDoc<FnPtr>(class_luarep<T>::class_name, "metamethod", metaname);
-        luaL_getmetatable(L,class_luarep<T>::mt_name.c_str());
+        GenDoc<FnPtr>(name, "metamethod", metaname);
+        CheckNotSealed();
+        class_luarep<T>::push_metatable(L);
         int mtidx = lua_gettop(L);
 
-        PushFunctionClosure<FnPtr,pol>(metaname, fnptr);
-        lua_setfield(L,mtidx,metaname);
+        PushFunctionClosure<FnPtr,pol>(fnptr);
+        SetMember(metaname,-1);
 
         lua_settop(L,mtidx-1);
 
@@ -812,13 +1190,16 @@ private:
      * of sharing Lua definitions across Lua states rather than allocating new function 
      * objects for each state.
      *
-     * The key is the function name, and the value is the function_def or
-     * custom_function_def pointer allocated by malloc in one of the .add functions.
+     * The key is the type of the def and the bytes of the function (or member data)
+     * pointer, see FindOrMakeDef, and the value is the function_def, custom_function_def
+     * or memdat_def pointer allocated by malloc in one of the .add functions. Only used
+     * with registry_mutex held.
      *
      * The type does not matter, this is only used to check if it has been registered before, 
      * and to delete it upon program exit.
      */
     static std::unordered_map<std::string,void*> registered_functions;
+    static std::mutex registry_mutex;
 };
 
 template<typename T>
@@ -827,4 +1208,7 @@ std::unordered_map<std::string,void*> class_luadef<T>::registered_functions;
 template<typename T>
 std::mutex class_luadef<T>::instantiate_mutex;
 
+template<typename T>
+std::mutex class_luadef<T>::registry_mutex;
+
 }
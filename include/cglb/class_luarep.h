@@ -5,9 +5,18 @@
  */
 #include "lua_include.h"
 #include "cglb_init.h"
+#include "object_holder.h"
+#include "state_context.h"
+#include "member_accessor.h"
+#include "member_hash.h"
 #include <vector>
+#include <string>
+#include <new>
+#include <utility>
 #include <assert.h>
 #include <algorithm>
+#include <iterator>
+#include <typeinfo>
 
 namespace cglb {
 
@@ -24,9 +33,15 @@ void default_classrep_deleter(T* obj);
 template <typename T>
 struct class_luarep
 {
-    //invalid default names for Lua, so this shouldn't clash 
-    static std::string class_name;
-    static std::string mt_name;
+    /**
+     * Returns what L knows about T (the class name, metatable, and so on), or nullptr
+     * if T has not been defined by class_luadef<T> in L.
+     */
+    static detail::type_context* context(lua_State* L)
+    {
+        detail::state_context* ctx = detail::state_context::get(L);
+        return ctx != nullptr ? ctx->type(detail::type_id<T>::get()) : nullptr;
+    }
 
 
     /**
@@ -34,6 +49,9 @@ struct class_luarep
      * class_luadef<T>'s "add" methods.
      * Set gc to true if the object should be destroyed upon garbage collection
      *
+     * If class_luadef<T>::identity_cache() is on for L, pushing a pointer which is
+     * already in Lua pushes the same userdata again.
+     *
      * Returns the index of the Lua stack where obj resides
      */
     static int push(lua_State* L, T* obj, bool gc = false)
@@ -44,63 +62,210 @@ struct class_luarep
             return lua_gettop(L);
         }
 
-        luaL_getmetatable(L, mt_name.c_str());                   //[1] = metatable
-        if(lua_isnoneornil(L,-1))
+        detail::type_context* tc = checked_context(L);
+        if(tc->identity_cache_ref == LUA_NOREF)
+        {
+            push_pointer(L,tc,0,0,obj,gc);                      //[1] = userdata
+            return lua_gettop(L);
+        }
+
+        lua_rawgeti(L,LUA_REGISTRYINDEX,tc->identity_cache_ref);   //[1] = cache table
+        int cacheidx = lua_gettop(L);
+        push_pointer(L,tc,0,cacheidx,obj,gc);                   //[2] = userdata
+        lua_replace(L,cacheidx);                                //[1] = [2]                 -> pop[2]
+        return cacheidx;
+    }
+
+
+    /**
+     * Pushes a new table with the objects of [first,last) at 1 to n. Works like calling
+     * push for each of them, except that the metatable (and the identity cache, if it is
+     * on) is only looked up once for the whole range, and the table is created with
+     * room for all of them. Null pointers are left as holes in the table.
+     *
+     * The iterators must be forward iterators to T*.
+     *
+     * Returns the index of the Lua stack where the table resides
+     */
+    template<typename Iter>
+    static int push_range(lua_State* L, Iter first, Iter last, bool gc = false)
+    {
+        detail::type_context* tc = checked_context(L);
+        lua_createtable(L,(int)std::distance(first,last),0);   //[1] = table
+        int tableidx = lua_gettop(L);
+        lua_rawgeti(L,LUA_REGISTRYINDEX,tc->metatable_ref);     //[2] = metatable
+        int mtidx = lua_gettop(L);
+        int cacheidx = 0;
+        if(tc->identity_cache_ref != LUA_NOREF)
         {
-            //If this error says that it is missing the metatable for '@', then
-            //the type <T> has not been defined by class_luadef<T>
-            luaL_error(L,"%s missing metatable", class_name.c_str());
+            lua_rawgeti(L,LUA_REGISTRYINDEX,tc->identity_cache_ref);   //[3] = cache table
+            cacheidx = lua_gettop(L);
         }
 
-        int mtidx = lua_gettop(L);                              //[mtidx] = [1]
-        T** ptrHold = (T**)lua_newuserdata(L,sizeof(T**));      //[2] = userdata
-        int udidx = lua_gettop(L);                              //[udidx] = [2]
-        if(ptrHold != NULL)
+        for(int i = 1; first != last; ++first, ++i)
         {
-            *ptrHold = obj;
-            lua_pushvalue(L,mtidx);                             //[3] = [1]
-            lua_setmetatable(L,udidx);                          //setmetatable([2],[3])     -> pop[3]
+            T* obj = *first;
+            if(!obj)
+                continue;
+            push_pointer(L,tc,mtidx,cacheidx,obj,gc);           //[n] = userdata
+            lua_rawseti(L,tableidx,i);                          //[1][i] = [n]              -> pop[n]
+        }
+        lua_settop(L,tableidx);                                 //pop[>1]
+        return tableidx;
+    }
 
-            //set the garbage collection data
-            char objname[32];
-            sprintf(objname,"%p",obj);
-            luaL_newmetatable(L,"DO NOT TRASH");                //[3] = "DO NOT TRASH" table
-            if(!gc)
-            {
-                lua_pushboolean(L,1);                           //[4] = true
-                lua_setfield(L,-2,objname);                     //[3][name] = [4]           -> pop[4]
-            }
+
+    /**
+     * Constructs a new T from args and pushes it on to the stack. The object is always
+     * owned by Lua. This is what constructor<...> and functions returning T by value use.
+     *
+     * If class_luadef<T>::store_values_inline() was used for T, then the object is
+     * constructed inside of the userdata itself and destroyed in place by __gc, so
+     * there is no allocation other than the userdata. If class_luadef<T>::use_pool()
+     * was used, then it is constructed in a block from the pool of T, and the block is
+     * given back to the pool by __gc. Otherwise it is allocated with new, and destroyed
+     * by the deleter of T like any other garbage collected object.
+     *
+     * Returns the index of the Lua stack where the new object resides
+     */
+    template<typename... Args>
+    static int emplace(lua_State* L, Args&&... args)
+    {
+        detail::type_context* tc = checked_context(L);
+        if(tc->inline_values && detail::can_store_inline<T>::value)
+            return emplace_inline(L,tc,0,std::forward<Args>(args)...);
+        if(tc->pool != nullptr && detail::can_pool<T>::value)
+            return emplace_pooled(L,tc,0,std::forward<Args>(args)...);
+        return push(L,new T(std::forward<Args>(args)...),true);
+    }
+
+
+    /**
+     * Pushes a new table with copies of the values of [first,last) at 1 to n, each made
+     * the same way as emplace makes them. The allocation strategy and the metatable are
+     * only looked up once for the whole range, and the table is created with room for
+     * all of them.
+     *
+     * The iterators must be forward iterators to T.
+     *
+     * Returns the index of the Lua stack where the table resides
+     */
+    template<typename Iter>
+    static int emplace_range(lua_State* L, Iter first, Iter last)
+    {
+        detail::type_context* tc = checked_context(L);
+        lua_createtable(L,(int)std::distance(first,last),0);   //[1] = table
+        int tableidx = lua_gettop(L);
+        lua_rawgeti(L,LUA_REGISTRYINDEX,tc->metatable_ref);     //[2] = metatable
+        int mtidx = lua_gettop(L);
+        int cacheidx = 0;
+        if(tc->identity_cache_ref != LUA_NOREF)
+        {
+            lua_rawgeti(L,LUA_REGISTRYINDEX,tc->identity_cache_ref);   //[3] = cache table
+            cacheidx = lua_gettop(L);
+        }
+
+        bool inline_values = tc->inline_values && detail::can_store_inline<T>::value;
+        bool pooled = tc->pool != nullptr && detail::can_pool<T>::value;
+        for(int i = 1; first != last; ++first, ++i)
+        {
+            if(inline_values)
+                emplace_inline(L,tc,mtidx,*first);              //[n] = userdata
+            else if(pooled)
+                emplace_pooled(L,tc,mtidx,*first);              //[n] = userdata
             else
-            {
-                lua_pushnil(L);                                 //[4] = nil
-                lua_setfield(L,-2,objname);                     //[3][name] = [4]           -> pop[4]
-            }
-            lua_pop(L,1);                                       //pop[3]
+                push_pointer(L,tc,mtidx,cacheidx,new T(*first),true);  //[n] = userdata
+            lua_rawseti(L,tableidx,i);                          //[1][i] = [n]              -> pop[n]
         }
-        lua_settop(L,udidx);                                    //pop[>2]
-        lua_replace(L,mtidx);                                   //swap([mtidx],[udidx])     -> pop[mtidx]
-        udidx = mtidx;
-        lua_settop(L,udidx);                                    //pop[>1], just to make sure
-        return udidx;
+        lua_settop(L,tableidx);                                 //pop[>1]
+        return tableidx;
     }
 
 
 
     /**
-     * For getting user type data from the Lua stack
+     * For getting user type data from the Lua stack. Works for every kind of storage,
+     * and gives NULL for a handle to an object which was invalidated.
+     *
+     * Returns NULL if the value at narg is not a T, or a type which inherits from T
+     * by class_luadef<Derived>::inherit<T>. The type is checked by comparing the
+     * type tag in the userdata, so there are no string compares, and a derived
+     * object is adjusted to the address of its T part.
      */
     static T* check(lua_State* L, int narg)
     {
-        T** ptrHold = static_cast<T**>(lua_touserdata(L,narg));
-        if(ptrHold == NULL)
+        detail::object_holder* holder = to_holder(L,narg);
+        if(holder == NULL)
             return NULL;
-        return *ptrHold;
+        void* obj = object_of(holder);
+        const detail::type_record* want = detail::type_record::of<T>();
+        if(holder->type == want)
+            return static_cast<T*>(obj);
+
+        std::ptrdiff_t offset = 0;
+        if(obj == NULL || !holder->type->cast_offset(want,offset))
+            return NULL;
+        return reinterpret_cast<T*>(static_cast<char*>(obj) + offset);
+    }
+
+
+    /**
+     * Same as check, but raises a Lua argument error rather than returning NULL
+     */
+    static T* check_arg(lua_State* L, int narg)
+    {
+        T* obj = check(L,narg);
+        if(obj == NULL)
+        {
+            const char* msg = lua_pushfstring(L,"%s expected, got %s", name_of(L), luaL_typename(L,narg));
+            luaL_argerror(L,narg,msg);
+        }
+        return obj;
+    }
+
+
+    /**
+     * Gives ownership of a garbage collected object at index narg back to C++, so that
+     * the deleter is no longer called for it. The userdata can still be used in Lua.
+     *
+     * Returns the object, or NULL if it was not owned by Lua. Objects stored inline
+     * or in a pool cannot be released, since their memory belongs to Lua.
+     */
+    static T* release(lua_State* L, int narg)
+    {
+        detail::object_holder* holder = to_holder(L,narg);
+        if(holder == NULL 
+        || holder->storage == detail::storage_inline
+        || holder->storage == detail::storage_pooled
+        || holder->owner != detail::ownership_owned)
+            return NULL;
+        T* obj = static_cast<T*>(object_of(holder));
+        if(obj != NULL)
+            holder->owner = detail::ownership_released;
+        return obj;
+    }
+
+
+    /**
+     * For types which use handles (class_luadef<T>::use_handles), makes every userdata
+     * in L which refers to obj fail check from now on, so that obj can be deleted while
+     * Lua still has references to it. Call it for each lua_State obj was pushed to.
+     *
+     * Returns false if obj is not referenced by a handle in L.
+     */
+    static bool invalidate(lua_State* L, T* obj)
+    {
+        detail::type_context* tc = context(L);
+        if(tc == nullptr || tc->handles == nullptr)
+            return false;
+        return tc->handles->invalidate((void*)obj);
     }
 
 
     /**
-     * Used as the __init metamethod. Instanced from
-     * class_luadef<T>::constructor<...>()
+     * The signature of the __init metamethod made by class_luadef<T>::constructor<...>().
+     * The metamethod itself constructs with emplace, so it follows store_values_inline and
+     * use_pool, and ConstructType is left for code which wants a new T from the same args.
      *
      * Note that this uses "new" for allocation. If malloc is the preferred allocator, then
      * class_luadef<T>::custom_constructor(function) is what you want.
@@ -123,14 +288,216 @@ private:
 
 
     /**
-      * Called from class_luadef<T> constructor.
+      * Called from class_luadef<T> constructor. Returns record_types if T was already
+      * defined in L.
       */
     static bool setup(lua_State* L, const char* name)
     {
-        class_name = name;
-        mt_name = name;
-        mt_name.append("_mt");
-        return Register(L);
+        detail::state_context* ctx = detail::state_context::get_or_create(L);
+        if(ctx->type(detail::type_id<T>::get()) != nullptr)
+            return record_types;
+
+        detail::type_context* tc = ctx->add_type(detail::type_id<T>::get());
+        tc->class_name = name;
+        tc->mt_name = name;
+        tc->mt_name.append("_mt");
+        const_cast<detail::type_record*>(detail::type_record::of<T>())->set_name(name);
+        Register(L,tc);
+        return false;
+    }
+
+
+    /**
+     * Pushes a userdata for obj, with the metatable at mtidx (or 0 to get it from tc),
+     * and the identity cache at cacheidx (or 0 if it is not used).
+     */
+    static void push_pointer(lua_State* L, detail::type_context* tc, int mtidx, int cacheidx, T* obj, bool gc)
+    {
+        //If the identity cache is on for this state, then an existing
+        //userdata for obj is reused rather than making a new one
+        if(cacheidx != 0 && find_cached(L,cacheidx,obj,gc))    //[1] = cached userdata
+            return;
+
+        detail::object_holder* holder = NULL;
+        if(tc->handles != nullptr)
+        {
+            detail::handle_holder* handle = reinterpret_cast<detail::handle_holder*>(
+                new_userdata(L,tc,sizeof(detail::handle_holder),mtidx));   //[1] = userdata
+            handle->map = tc->handles;
+            handle->slot = tc->handles->acquire((void*)obj,handle->generation);
+            holder = &handle->header;
+            holder->storage = detail::storage_handle;
+        }
+        else
+        {
+            holder = new_userdata(L,tc,sizeof(detail::object_holder),mtidx);    //[1] = userdata
+            holder->storage = detail::storage_pointer;
+        }
+        holder->obj = obj;
+        holder->owner = gc ? detail::ownership_owned : detail::ownership_borrowed;
+
+        if(cacheidx != 0)
+        {
+            lua_pushlightuserdata(L,(void*)obj);                //[2] = obj
+            lua_pushvalue(L,-2);                                //[3] = [1]
+            lua_rawset(L,cacheidx);                             //cache[obj] = [1]          -> pop[3,2]
+        }
+    }
+
+
+    /**
+     * The paths of emplace which do not use new. mtidx is the same as for push_pointer.
+     */
+    template<typename... Args>
+    static int emplace_inline(lua_State* L, detail::type_context* tc, int mtidx, Args&&... args)
+    {
+        typedef detail::inline_holder<T> HolderT;
+        //obj is NULL until constructed, so that __gc skips it if the constructor throws
+        HolderT* holder = reinterpret_cast<HolderT*>(new_userdata(L,tc,sizeof(HolderT),mtidx));  //[1] = userdata
+        holder->header.storage = detail::storage_inline;
+        holder->header.owner = detail::ownership_owned;
+        holder->header.obj = new (&holder->data) T(std::forward<Args>(args)...);
+        return lua_gettop(L);
+    }
+
+
+    template<typename... Args>
+    static int emplace_pooled(lua_State* L, detail::type_context* tc, int mtidx, Args&&... args)
+    {
+        detail::object_holder* holder =                         //[1] = userdata
+            new_userdata(L,tc,sizeof(detail::object_holder),mtidx);
+        holder->storage = detail::storage_pooled;
+        holder->owner = detail::ownership_owned;
+        //obj is NULL until constructed, so that __gc skips it if the constructor throws
+        void* block = tc->pool->allocate();
+        try
+        {
+            holder->obj = new (block) T(std::forward<Args>(args)...);
+        }
+        catch(...)
+        {
+            detail::storage_pool::deallocate(block);
+            throw;
+        }
+        return lua_gettop(L);
+    }
+
+
+    /**
+     * Same as context, but raises a Lua error rather than returning nullptr
+     */
+    static detail::type_context* checked_context(lua_State* L)
+    {
+        detail::type_context* tc = context(L);
+        if(tc == nullptr)
+        {
+            //the type <T> has not been defined by class_luadef<T> in this lua_State
+            luaL_error(L,"%s missing metatable", name_of(L));
+        }
+        return tc;
+    }
+
+
+    /**
+     * Pushes a new userdata of size bytes which has the metatable of T set on it, and
+     * the type tag of T set in its holder. The metatable is the one at mtidx, or if
+     * mtidx is 0, the one referenced by tc.
+     */
+    static detail::object_holder* new_userdata(lua_State* L, detail::type_context* tc, size_t size, int mtidx = 0)
+    {
+        detail::object_holder* holder =                         //[1] = userdata
+            static_cast<detail::object_holder*>(lua_newuserdata(L,size));
+        holder->obj = NULL;
+        holder->type = detail::type_record::of<T>();
+        holder->magic = detail::holder_magic(holder->type);
+        if(mtidx != 0)
+            lua_pushvalue(L,mtidx);                             //[2] = metatable
+        else
+            lua_rawgeti(L,LUA_REGISTRYINDEX,tc->metatable_ref); //[2] = metatable
+        lua_setmetatable(L,-2);                                 //setmetatable([1],[2])     -> pop[2]
+        return holder;
+    }
+
+
+    /**
+     * The object a holder refers to, or NULL if it is a handle which was invalidated
+     */
+    static void* object_of(detail::object_holder* holder)
+    {
+        if(holder->storage != detail::storage_handle)
+            return holder->obj;
+        detail::handle_holder* handle = reinterpret_cast<detail::handle_holder*>(holder);
+        return handle->map->get(handle->slot,handle->generation);
+    }
+
+
+    /**
+     * Returns the holder at narg, or NULL if it is not a userdata made by class_luarep
+     */
+    static detail::object_holder* to_holder(lua_State* L, int narg)
+    {
+        if(lua_type(L,narg) != LUA_TUSERDATA)
+            return NULL;
+#if LUA_VERSION_NUM >= 502
+        size_t len = lua_rawlen(L,narg);
+#else
+        size_t len = lua_objlen(L,narg);
+#endif
+        detail::object_holder* holder = static_cast<detail::object_holder*>(lua_touserdata(L,narg));
+        if(len < sizeof(detail::object_holder) || holder->magic != detail::holder_magic(holder->type))
+            return NULL;
+        return holder;
+    }
+
+
+    /**
+     * Turns the identity cache on or off for L. The cache is a table in the registry
+     * with weak values, mapping a T* (as light userdata) to the userdata pushed for it.
+     */
+    static void set_identity_cache(lua_State* L, bool enable)
+    {
+        detail::type_context* tc = checked_context(L);
+        if(enable == (tc->identity_cache_ref != LUA_NOREF))
+            return;
+
+        if(enable)
+        {
+            lua_newtable(L);                                    //[1] = cache
+            lua_createtable(L,0,1);                             //[2] = metatable for the cache
+            lua_pushstring(L,"v");                              //[3] = "v"
+            lua_setfield(L,-2,"__mode");                        //[2].__mode = [3]          -> pop[3]
+            lua_setmetatable(L,-2);                             //setmetatable([1],[2])     -> pop[2]
+            tc->identity_cache_ref = luaL_ref(L,LUA_REGISTRYINDEX); //                      -> pop[1]
+        }
+        else
+        {
+            luaL_unref(L,LUA_REGISTRYINDEX,tc->identity_cache_ref);
+            tc->identity_cache_ref = LUA_NOREF;
+        }
+    }
+
+    /**
+     * If the cache at cacheidx has a live userdata for obj, then it is pushed
+     * and true is returned. Otherwise the stack is unchanged.
+     *
+     * Pushing with gc to an object which was only borrowed makes Lua the owner.
+     */
+    static bool find_cached(lua_State* L, int cacheidx, T* obj, bool gc)
+    {
+        lua_pushlightuserdata(L,(void*)obj);                    //[2] = obj
+        lua_rawget(L,cacheidx);                                 //[2] = cache[obj]
+        detail::object_holder* holder = static_cast<detail::object_holder*>(lua_touserdata(L,-1));
+        if(holder == NULL 
+        || holder->obj != (void*)obj
+        || holder->owner == detail::ownership_released
+        || object_of(holder) == NULL)
+        {
+            lua_pop(L,1);                                       //pop[2]
+            return false;
+        }
+        if(gc && holder->owner == detail::ownership_borrowed)
+            holder->owner = detail::ownership_owned;
+        return true;
     }
 
     /**
@@ -143,7 +510,10 @@ private:
      * class_luadef<T>::destructor(function) call
      *
      * If class_luarep<T>::push function was called and the "gc" argument was false,
-     * then the deleter will not be called.
+     * or the object was given back with class_luarep<T>::release, then the deleter 
+     * will not be called. It is also not called for objects stored
+     * inline or pooled by class_luarep<T>::emplace, since they are destroyed in place,
+     * or for handles to objects which were invalidated.
      */
     template<typename FnPtr>
     struct deleter
@@ -153,26 +523,49 @@ private:
         
         FnPtr delete_func;
         /*
-            Upvalue index 1 is an instance of this class
+            Upvalue index 1 is an instance of this class, in a full userdata
+            so that it is freed with the lua_State
         */
         static int gc_metamethod(lua_State* L)
         {
-            T* obj = check(L,1);                                //[1] = T* instance
-            if(obj == NULL)
+            detail::object_holder* holder =                     //[1] = T userdata
+                static_cast<detail::object_holder*>(lua_touserdata(L,1));
+            if(holder == NULL || holder->obj == NULL)
                 return 0;
 
-            luaL_newmetatable(L,"DO NOT TRASH");                //[2] = "DO NOT TRASH" table
-            char objname[32];
-            sprintf(objname,"%p",obj);
-            lua_getfield(L,-1,objname);                         //[3] = [2][objname]
-            if(lua_isnoneornil(L,-1))
+            T* obj = static_cast<T*>(holder->obj);
+            //handles give up their slot, and delete the object only if it is
+            //owned by Lua and has not been invalidated
+            if(holder->storage == detail::storage_handle)
+            {
+                detail::handle_holder* handle = reinterpret_cast<detail::handle_holder*>(holder);
+                if(holder->owner == detail::ownership_owned && object_of(holder) != NULL)
+                {
+                    handle->map->invalidate(holder->obj);
+                    deleter<FnPtr>* self = (deleter<FnPtr>*)lua_touserdata(L,lua_upvalueindex(1));
+                    (*(self->delete_func))(obj);
+                }
+                handle->map->release(handle->slot);
+            }
+            //inline objects are always owned by their userdata, and the
+            //memory is freed by Lua, so only the destructor is run
+            else if(holder->storage == detail::storage_inline)
             {
-                deleter<FnPtr>* self = (deleter<FnPtr>*)current_deleter;
+                obj->~T();
+            }
+            //same for pooled objects, except that the block goes back to the pool
+            else if(holder->storage == detail::storage_pooled)
+            {
+                obj->~T();
+                detail::storage_pool::deallocate(obj);
+            }
+            else if(holder->owner == detail::ownership_owned)
+            {
+                deleter<FnPtr>* self = (deleter<FnPtr>*)lua_touserdata(L,lua_upvalueindex(1));
                 (*(self->delete_func))(obj);
-                lua_pushboolean(L,1);                           //[4] = true
-                lua_setfield(L,-3,objname);                     //[2][objname] = [4]        -> pop[4]
             }
-            lua_pop(L,3);                                       //pop[3,2,1]
+            holder->owner = detail::ownership_released;
+            holder->obj = NULL;
             return 0;
         }
     };
@@ -181,70 +574,39 @@ private:
     template<typename Func>
     static void set_deleter(lua_State* L, Func f)
     {
-        if(current_deleter != nullptr)
-        {
-            free(current_deleter);
-            current_deleter = nullptr;
-        }
-        
-        luaL_newmetatable(L,mt_name.c_str());                   //[1] = mt
+        push_metatable(L);                                      //[1] = mt
         int metaidx = lua_gettop(L);
-        deleter<Func>* fn = (deleter<Func>*)malloc(sizeof(deleter<Func>));
-        current_deleter = (void*)fn;
-        if(fn != NULL)
-        {
-            fn->delete_func = f;
-            lua_pushcfunction(L,deleter<Func>::gc_metamethod);
-            lua_setfield(L,metaidx,"__gc");                     //pop[2]
-        }
+        void* block = lua_newuserdata(L,sizeof(deleter<Func>)); //[2] = deleter
+        new (block) deleter<Func>(f);
+        lua_pushcclosure(L,deleter<Func>::gc_metamethod,1);     //[2] = gc_metamethod      -> pop[2]
+        lua_setfield(L,metaidx,"__gc");                         //pop[2]
         lua_settop(L,metaidx-1); //stack cleanup
     }
 
-    /**
-     * Defines the pointer to a deleter<?> object, hence the void*
-     */
-    static void* current_deleter;
-
-    /**
-     * For use after the library is shut down. If this is not called,
-     * then it is a memory leak.
-     */
-    static void DeallocateDeleter()
-    {
-        free(current_deleter);
-        current_deleter = nullptr;
-    }
-
 
 
     /**
-     * Checks to see if Register has been called for this lua_State before, and if not,
-     * registers the basic metamethods.
+     * Registers the basic metamethods of T in L, and keeps references to the
+     * tables in tc.
      */
-    static bool Register(lua_State* L)
+    static void Register(lua_State* L, detail::type_context* tc)
     {
-        luaL_getmetatable(L,mt_name.c_str());
-        //See if it has been registered already
-        if(!lua_isnoneornil(L,-1))
-        {
-            lua_pop(L,1);
-            return record_types;
-        }
-        lua_pop(L,1);
         lua_newtable(L);                                //[1] = table
         int methods = lua_gettop(L);                    //methods = [1]
 
         //We use mt_name here so that we can have a 
         //C-looking constructor function that is the
         //name of the type
-        luaL_newmetatable(L,mt_name.c_str());           //[2] = table in the registry named $mt_name
+        luaL_newmetatable(L,tc->mt_name.c_str());       //[2] = table in the registry named $mt_name
         int metaidx = lua_gettop(L);                    //metaidx = [2]
 
-        luaL_newmetatable(L,"DO NOT TRASH");            //[3] = table in the registry named "DO NOT TRASH"
-        lua_pop(L,1);                                   //pop[3]
+        //everything else finds the metatable by reference,
+        //which is not a string lookup
+        lua_pushvalue(L,metaidx);                       //[3] = metatable
+        tc->metatable_ref = luaL_ref(L,LUA_REGISTRYINDEX);  //                                  -> pop[3]
 
         lua_pushvalue(L,methods);                       //[3] = methods
-        lua_setglobal(L,mt_name.c_str());               //["_G"][mt_name] = [3]                 -> pop[3]
+        lua_setglobal(L,tc->mt_name.c_str());           //["_G"][mt_name] = [3]                 -> pop[3]
 
         //make it so that [get|set]metatable returns
         //the methods table
@@ -256,180 +618,430 @@ private:
         lua_pushcfunction(L,tostring);                  //[3] = this::tostring
         lua_setfield(L,metaidx,"__tostring");           //pop[3]
 
-        lua_pushcfunction(L,index);                     //[3] = this::index
+        //__index and __newindex get the metatable as an upvalue,
+        //so the per access cost is only the lookup of the key
+        lua_pushvalue(L,metaidx);                       //[3] = metatable
+        lua_pushcclosure(L,index_closure,1);            //[3] = this::index_closure             -> pop[3]
         lua_setfield(L,metaidx,"__index");              //pop[3]
 
-        lua_pushcfunction(L,newindex);                  //[3] = this::newindex
+        lua_pushvalue(L,metaidx);                       //[3] = metatable
+        lua_pushcclosure(L,newindex_closure,1);         //[3] = this::newindex_closure          -> pop[3]
         lua_setfield(L,metaidx,"__newindex");           //pop[3]
 
-        lua_newtable(L);
-        lua_setfield(L,methods,"__cglb_getters");
-        lua_newtable(L);
-        lua_setfield(L,methods,"__cglb_setters");
-
         //Why can this be empty?
         lua_newtable(L);                                //[3] = table
         lua_setmetatable(L,methods);                    //setmetatable(["_G"][mt_name],[3])     -> pop[3]
        
         lua_settop(L,methods - 1);                      //pop[>=methods]
-        return false;
     }
 
-public:
-    //__tostring
-    static int tostring(lua_State* L)
+
+    /**
+     * Builds the member_hash of T for L from the string keys of the metatable, and makes
+     * __index and __newindex the sealed closures which look in it first. Keys starting
+     * with "__" are left out, since they are metamethods and not members.
+     *
+     * Raises a Lua error, and leaves T unsealed, if no perfect hash could be found.
+     */
+    static void seal(lua_State* L)
     {
-        char buff[32];
-        T** ptrHold = (T**)lua_touserdata(L,1);
-        T* obj = *ptrHold;
-        sprintf(buff,"%p",obj);
-        lua_pushfstring(L, "%s (%s)", class_name.c_str(), buff);//[1] = string
-        return 1;
-    }
+        detail::type_context* tc = checked_context(L);
+        if(tc->sealed)
+            return;
 
+        lua_rawgeti(L,LUA_REGISTRYINDEX,tc->metatable_ref);     //[1] = metatable
+        int mtidx = lua_gettop(L);
+        lua_newtable(L);                                        //[2] = values
+        int valuesidx = lua_gettop(L);
 
-    static int index(lua_State* L)
-    {
-        /* Upon calling this function, Lua has placed on the stack:
-                                                              [1] = table/userdata
-                                                              [2] = key
-        */
-        int objidx = lua_gettop(L) - 1;
-        int keyidx = lua_gettop(L);
-        luaL_getmetatable(L,mt_name.c_str());                   //[3] = _G[mt_name] table
-        std::string strkey = lua_tostring(L,keyidx);
-        if(lua_istable(L,-1))
-        {
-            lua_pushvalue(L,keyidx);                        //[4] = key
-            lua_rawget(L,-2);                               //[4] = [mt_name][key]
-            //if they key is not in the immediate table
-            if(lua_isnoneornil(L,-1))
+        std::vector<detail::member_hash_entry> members;
+        int values = 0;
+        lua_pushnil(L);                                         //[3] = nil
+        while(lua_next(L,mtidx) != 0)                           //[3] = key, [4] = value
+        {
+            if(lua_type(L,-2) == LUA_TSTRING)
             {
-                lua_pop(L,1);                               //pop[4] (nil)
-                lua_pushstring(L,"__cglb_getters");         //[4] = string
-                lua_rawget(L,-2);                           //[4] = custom __getters metamethod
-                //we are now working on the __cglb_getters table
-                lua_pushvalue(L,keyidx);                    //[5] = key
-                lua_rawget(L,-2);                           //[5] = __cglb_getters[key]
-                if(lua_type(L,-1) == LUA_TFUNCTION)
+                //the key is a string already, so lua_tostring does not change it,
+                //and gives the address of the interned string
+                const char* key = lua_tostring(L,-2);
+                if(key[0] != '_' || key[1] != '_')
                 {
-                    int before_fcalltop = lua_gettop(L) - 1;//-1 to go below the function
-                    lua_pushvalue(L,objidx);                //[6] = table/userdata
-                    lua_pushvalue(L,keyidx);                //[7] = key
-                    if(lua_pcall(L,2,LUA_MULTRET,0) != 0)   //[6+] = result of the function
+                    detail::member_hash_entry entry;
+                    entry.key = key;
+                    entry.accessor = nullptr;
+                    entry.value = 0;
+                    if(lua_type(L,-1) == LUA_TUSERDATA)
                     {
-                        luaL_error(L,"%s.__index for %s",class_name.c_str(),lua_tostring(L,2));
+                        entry.accessor = static_cast<detail::member_accessor*>(lua_touserdata(L,-1));
                     }
                     else
                     {
-                        return lua_gettop(L) - before_fcalltop;
+                        entry.value = ++values;
+                        lua_pushvalue(L,-1);                    //[5] = [4]
+                        lua_rawseti(L,valuesidx,values);        //[2][values] = [5]         -> pop[5]
                     }
+                    members.push_back(entry);
                 }
-                //it isn't a getter, check __index
-                else
+            }
+            lua_pop(L,1);                                       //pop[4]
+        }
+
+        uint64_t multiplier = 0;
+        unsigned shift = 0;
+        size_t size = detail::member_hash::build(members,multiplier,shift);
+        if(size == 0)
+        {
+            lua_settop(L,mtidx-1);                              //pop[>=1]
+            std::vector<detail::member_hash_entry>().swap(members);  //luaL_error skips the destructor
+            luaL_error(L,"Could not build the member hash to seal %s",name_of(L));
+            return;
+        }
+        detail::member_hash* hash = static_cast<detail::member_hash*>(
+            lua_newuserdata(L,detail::member_hash::bytes_for(size)));   //[3] = hash
+        int hashidx = lua_gettop(L);
+        hash->multiplier = multiplier;
+        hash->shift = shift;
+        hash->size = size;
+        for(size_t i = 0; i < size; ++i)
+        {
+            hash->entries[i].key = nullptr;
+            hash->entries[i].accessor = nullptr;
+            hash->entries[i].value = 0;
+        }
+        for(detail::member_hash_entry const& entry : members)
+        {
+            hash->entries[detail::member_hash::slot(entry.key,multiplier,shift)] = entry;
+        }
+
+        lua_pushvalue(L,mtidx);                                 //[4] = metatable
+        lua_pushvalue(L,hashidx);                               //[5] = hash
+        lua_pushvalue(L,valuesidx);                             //[6] = values
+        lua_pushcclosure(L,sealed_index_closure,3);             //[4] = sealed_index_closure -> pop[6,5,4]
+        lua_setfield(L,mtidx,"__index");                        //pop[4]
+
+        lua_pushvalue(L,mtidx);                                 //[4] = metatable
+        lua_pushvalue(L,hashidx);                               //[5] = hash
+        lua_pushcclosure(L,sealed_newindex_closure,2);          //[4] = sealed_newindex_closure -> pop[5,4]
+        lua_setfield(L,mtidx,"__newindex");                     //pop[4]
+
+        tc->sealed = true;
+        lua_settop(L,mtidx-1);                                  //pop[>=1]
+    }
+
+
+    /**
+     * Sets what __newindex does with keys which are not writable members of T in L
+     */
+    static void set_unknown_keys(lua_State* L, unknown_key_policy policy, lua_CFunction hook)
+    {
+        detail::type_context* tc = checked_context(L);
+        tc->unknown_keys = policy;
+        tc->unknown_key_hook = hook;
+        bool bags = policy == unknown_keys_property_bag;
+        if(bags == (tc->property_bags_ref != LUA_NOREF))
+            return;
+
+        if(bags)
+        {
+            //the bags are kept by userdata, with weak keys
+            lua_newtable(L);                                    //[1] = bags
+            lua_createtable(L,0,1);                             //[2] = metatable for the bags
+            lua_pushstring(L,"k");                              //[3] = "k"
+            lua_setfield(L,-2,"__mode");                        //[2].__mode = [3]          -> pop[3]
+            lua_setmetatable(L,-2);                             //setmetatable([1],[2])     -> pop[2]
+            tc->property_bags_ref = luaL_ref(L,LUA_REGISTRYINDEX);  //                      -> pop[1]
+        }
+        else
+        {
+            luaL_unref(L,LUA_REGISTRYINDEX,tc->property_bags_ref);
+            tc->property_bags_ref = LUA_NOREF;
+        }
+    }
+
+    /**
+     * The class name of T in L, for error messages. If T is not defined in L, the name
+     * it was defined with in another lua_State, if any.
+     */
+    static const char* name_of(lua_State* L)
+    {
+        detail::type_context* tc = context(L);
+        if(tc != nullptr)
+            return tc->class_name.c_str();
+        const char* first = detail::type_record::of<T>()->name();
+        return first != nullptr ? first : typeid(T).name();
+    }
+
+
+    /**
+     * The __index and __newindex metamethods. Same as index and newindex, except
+     * that the metatable comes from the upvalue.
+     */
+    static int index_closure(lua_State* L)
+    {
+        return index_impl(L,1,2,lua_upvalueindex(1));
+    }
+
+    /**
+     * __index of a sealed type. Upvalue 1 is the metatable, 2 is the member_hash, and 3
+     * is the table of values which the hash refers to for methods. The metatable is
+     * only looked in for keys which are not in the hash.
+     */
+    static int sealed_index_closure(lua_State* L)
+    {
+        if(lua_type(L,2) == LUA_TSTRING)
+        {
+            const detail::member_hash* hash =
+                static_cast<const detail::member_hash*>(lua_touserdata(L,lua_upvalueindex(2)));
+            const detail::member_hash_entry* entry = hash->find(lua_tostring(L,2));
+            if(entry != nullptr)
+            {
+                if(entry->accessor == nullptr)
                 {
-                    lua_settop(L,4);                        //pop[>4]
-                    lua_getmetatable(L,objidx);             //[5] = metatable for [1]
-                    //if there is a metatable
-                    if(lua_istable(L,-1))
-                    {
-                        lua_pushstring(L,"__index");        //[6] = "__index"
-                        lua_rawget(L,-2);                   //[6] = mt.__index
-                        if(lua_isfunction(L,-1))
-                        {
-                            int before_fcalltop = lua_gettop(L) - 1; //-1 to go below the function
-                            lua_pushvalue(L,-2);            //[7] = mt (rather than userdata)
-                            lua_pushvalue(L,keyidx);        //[8] = key
-                            if(lua_pcall(L,2,1,0) != 0)     //[7] = result of the function
-                            {
-                                luaL_error(L,"%s.__index for %s",class_name.c_str(),lua_tostring(L,2));
-                            }
-                            else
-                            {
-                                return lua_gettop(L) - before_fcalltop;
-                            }
-
-                        }
-                        else if(lua_istable(L,-1))
-                        {
-                            lua_pushvalue(L,keyidx);        //[7] = key
-                            lua_rawget(L,-2);               //[7] = __index[key]
-                        }
-                        else
-                        {
-                            lua_pushnil(L);                 //[7] = nil
-                        }
-                    }
-                    //if it doesn't have a metatable, then
-                    //the key does not exist for the object
-                    else 
-                    {
-                        lua_pushnil(L);                     //[6] = nil
-                    }
+                    lua_rawgeti(L,lua_upvalueindex(3),entry->value);    //[3] = method
+                    return 1;
+                }
+                if(entry->accessor->get != nullptr)
+                {
+                    lua_settop(L,2);
+                    return entry->accessor->get(L,entry->accessor->get_def);
                 }
             }
-            //if we can get it directly from the table
-            else if(lua_istable(L,-1)) 
+        }
+        return index_impl(L,1,2,lua_upvalueindex(1));
+    }
+
+    static int newindex_closure(lua_State* L)
+    {
+        return newindex_impl(L,lua_upvalueindex(1));
+    }
+
+    /**
+     * __newindex of a sealed type. Upvalue 1 is the metatable, and 2 is the member_hash
+     */
+    static int sealed_newindex_closure(lua_State* L)
+    {
+        if(lua_type(L,2) == LUA_TSTRING)
+        {
+            const detail::member_hash* hash =
+                static_cast<const detail::member_hash*>(lua_touserdata(L,lua_upvalueindex(2)));
+            const detail::member_hash_entry* entry = hash->find(lua_tostring(L,2));
+            if(entry != nullptr && entry->accessor != nullptr && entry->accessor->set != nullptr)
             {
-                lua_pushvalue(L,keyidx);                    //[5] = key
-                lua_rawget(L,-2);                           //[5] = [mt][key]
-            } 
-            //if it is anything other than nil or table, 
-            //then the value is already at the top of the stack
+                lua_settop(L,3);
+                lua_replace(L,2);                           //[2] = value
+                return entry->accessor->set(L,entry->accessor->set_def);
+            }
         }
-        else //if _G[mt_name] != table
+        return newindex_impl(L,lua_upvalueindex(1));
+    }
+
+
+    /**
+     * Methods, metamethods and member_accessors all live in the metatable, so this is
+     * a single lookup of the key. Getters are called directly rather than through
+     * lua_pcall, so their errors are raised as they are.
+     */
+    static int index_impl(lua_State* L, int objidx, int keyidx, int mtidx)
+    {
+        lua_pushvalue(L,keyidx);                            //[n+1] = key
+        lua_rawget(L,mtidx);                                //[n+1] = [mt][key]
+        int type = lua_type(L,-1);
+        //methods are the result as is
+        if(type != LUA_TUSERDATA && type != LUA_TNIL)
+            return 1;
+        if(type == LUA_TNIL)
+            return index_unknown(L,objidx,keyidx);
+
+        detail::member_accessor* accessor = static_cast<detail::member_accessor*>(lua_touserdata(L,-1));
+        if(accessor->get == nullptr)                        //write only
+            return index_unknown(L,objidx,keyidx);
+        if(objidx == 1 && keyidx == 2)
         {
-            lua_pushnil(L);                                 //[4] = nil
+            //the stack is already how the getter wants it
+            lua_settop(L,2);                                //pop[>2]
+            return accessor->get(L,accessor->get_def);      //[3+] = result of the getter
         }
 
-        return 1;
+        //called from a user defined __index, with the object and key somewhere
+        //else on the stack, so call the getter with a fresh stack
+        int before_fcalltop = lua_gettop(L) - 1;
+        lua_pushcclosure(L,call_getter,1);                  //[n+1] = call_getter          -> pop[n+1]
+        lua_pushvalue(L,objidx);                            //[n+2] = table/userdata
+        lua_pushvalue(L,keyidx);                            //[n+3] = key
+        lua_call(L,2,LUA_MULTRET);                          //[n+1+] = result of the getter
+        return lua_gettop(L) - before_fcalltop;
     }
 
+    /**
+     * Upvalue 1 is a member_accessor, index 1 is the object, and index 2 is the key
+     */
+    static int call_getter(lua_State* L)
+    {
+        detail::member_accessor* accessor =
+            static_cast<detail::member_accessor*>(lua_touserdata(L,lua_upvalueindex(1)));
+        return accessor->get(L,accessor->get_def);
+    }
 
 
-    static int newindex(lua_State* L)
+    /**
+     * For keys which are not readable members of T. Pushes the value from the property bag
+     * of the object if T has them in L, or nil.
+     */
+    static int index_unknown(lua_State* L, int objidx, int keyidx)
+    {
+        detail::type_context* tc = context(L);
+        if(tc == nullptr || tc->property_bags_ref == LUA_NOREF)
+        {
+            lua_pushnil(L);                                 //[n+1] = nil
+            return 1;
+        }
+        lua_rawgeti(L,LUA_REGISTRYINDEX,tc->property_bags_ref);    //[n+1] = bags
+        lua_pushvalue(L,objidx);                            //[n+2] = obj
+        lua_rawget(L,-2);                                   //[n+2] = bags[obj]
+        if(lua_type(L,-1) != LUA_TTABLE)
+        {
+            lua_pushnil(L);                                 //[n+3] = nil
+            return 1;
+        }
+        lua_pushvalue(L,keyidx);                            //[n+3] = key
+        lua_rawget(L,-2);                                   //[n+3] = bags[obj][key]
+        return 1;
+    }
+
+
+    /**
+     * Setters are called directly with the object and the value, rather than through
+     * lua_pcall with the arguments pushed again. Anything which is not a writable member
+     * is handled by newindex_unknown.
+     */
+    static int newindex_impl(lua_State* L, int mtidx)
     {
         /*  When this function is called, the top three items on the stack are
                                                               [1] = table/userdata
                                                               [2] = key
                                                               [3] = value
         */
-        //check  to see if the key is in our custom __setters metafunction
-        int validx = lua_gettop(L);
-        int keyidx = 2;
-        int objidx = 1;
-        luaL_getmetatable(L,mt_name.c_str());               //[4] = _G[mt_name]
-        lua_pushstring(L,"__cglb_setters");                 //[5] = string
-        lua_rawget(L,-2);                                   //[5] = mt_name[__cglb_setters]
-        
-        lua_pushvalue(L,keyidx);                            //[6] = key
-        lua_rawget(L,-2);                                   //[6] = [5][key]
-        //all setters are functions defined from class_luadef<T>
-        if(lua_type(L,-1) == LUA_TFUNCTION)
-        {
-            lua_pushvalue(L,objidx);                        //[7] = obj
-            lua_pushvalue(L,keyidx);                        //[8] = key
-                                                            //[9+] = value(s)
-            for(int i = keyidx + 1; i <= validx; ++i)
+        lua_pushvalue(L,2);                                 //[n+1] = key
+        lua_rawget(L,mtidx);                                //[n+1] = [mt][key]
+        if(lua_type(L,-1) == LUA_TUSERDATA)
+        {
+            detail::member_accessor* accessor = static_cast<detail::member_accessor*>(lua_touserdata(L,-1));
+            if(accessor->set != nullptr)
             {
-                lua_pushvalue(L,i);
+                lua_settop(L,3);                            //pop[>3]
+                lua_replace(L,2);                           //[2] = value                   -> pop[3]
+                return accessor->set(L,accessor->set_def);
             }
-            if(lua_pcall(L,validx - keyidx,0,0) != 0) 
-                luaL_error(L,"%s.__newindex for %s",class_name.c_str(),lua_tostring(L,keyidx));
         }
-        return 0;
+        lua_settop(L,3);                                    //pop[>3]
+        return newindex_unknown(L);
     }
 
-};
+    /**
+     * Does what the unknown_key_policy of T in L says with [1][2] = [3]
+     */
+    static int newindex_unknown(lua_State* L)
+    {
+        detail::type_context* tc = context(L);
+        if(tc == nullptr)
+            return 0;
 
-//invalid names for Lua, so this shouldn't clash 
-template<typename T>
-std::string class_luarep<T>::class_name = "@";
-template<typename T>
-std::string class_luarep<T>::mt_name = "@";
+        switch(tc->unknown_keys)
+        {
+        case unknown_keys_error:
+            return luaL_error(L,"%s has no writable member %s", tc->class_name.c_str(),
+                lua_type(L,2) == LUA_TSTRING ? lua_tostring(L,2) : luaL_typename(L,2));
 
-template<typename T>
-void* class_luarep<T>::current_deleter = nullptr;
+        case unknown_keys_property_bag:
+            lua_rawgeti(L,LUA_REGISTRYINDEX,tc->property_bags_ref);    //[4] = bags
+            lua_pushvalue(L,1);                             //[5] = obj
+            lua_rawget(L,4);                                //[5] = bags[obj]
+            if(lua_type(L,5) != LUA_TTABLE)
+            {
+                if(lua_isnil(L,3))
+                    return 0;
+                lua_pop(L,1);                               //pop[5]
+                lua_newtable(L);                            //[5] = bag
+                lua_pushvalue(L,1);                         //[6] = obj
+                lua_pushvalue(L,5);                         //[7] = bag
+                lua_rawset(L,4);                            //bags[obj] = bag               -> pop[7,6]
+            }
+            lua_pushvalue(L,2);                             //[6] = key
+            lua_pushvalue(L,3);                             //[7] = value
+            lua_rawset(L,5);                                //bag[key] = value              -> pop[7,6]
+            return 0;
+
+        case unknown_keys_custom:
+            if(tc->unknown_key_hook != nullptr)
+                return tc->unknown_key_hook(L);
+            return 0;
+
+        default:
+            return 0;
+        }
+    }
+
+public:
+    /**
+     * Pushes the metatable of T for L, or nil if T has not been defined in L
+     */
+    static void push_metatable(lua_State* L)
+    {
+        detail::type_context* tc = context(L);
+        if(tc == nullptr)
+            lua_pushnil(L);
+        else
+            lua_rawgeti(L,LUA_REGISTRYINDEX,tc->metatable_ref);
+    }
+
+
+    //__tostring
+    static int tostring(lua_State* L)
+    {
+        char buff[32];
+        T* obj = check(L,1);
+        sprintf(buff,"%p",obj);
+        lua_pushfstring(L, "%s (%s)", name_of(L), buff);       //[1] = string
+        return 1;
+    }
+
+
+    /**
+     * The default __index behavior. Can be called from a user defined __index
+     * function with the object and key as the top two items of the stack.
+     */
+    static int index(lua_State* L)
+    {
+        /* Upon calling this function, Lua has placed on the stack:
+                                                              [1] = table/userdata
+                                                              [2] = key
+        */
+        int objidx = lua_gettop(L) - 1;
+        int keyidx = lua_gettop(L);
+        if(context(L) == nullptr)
+        {
+            lua_pushnil(L);                                 //[3] = nil
+            return 1;
+        }
+        push_metatable(L);                                  //[3] = metatable
+        return index_impl(L,objidx,keyidx,keyidx + 1);
+    }
+
+
+    /**
+     * The default __newindex behavior. Can be called from a user defined __newindex
+     * function with the object, key and value at index 1, 2 and 3.
+     */
+    static int newindex(lua_State* L)
+    {
+        lua_settop(L,3);
+        if(context(L) == nullptr)
+            return 0;
+        push_metatable(L);                                  //[4] = metatable
+        return newindex_impl(L,4);
+    }
+
+};
 
 template<typename T>
 void default_classrep_deleter(T* obj)
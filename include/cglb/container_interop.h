@@ -0,0 +1,314 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "lua_include.h"
+#include "class_luarep.h"
+#include "integer_interop.h"
+#include "string_ref.h"
+#include <type_traits>
+#include <vector>
+#include <array>
+#include <string>
+#include <utility>
+
+namespace cglb {
+namespace detail {
+
+
+/**
+ * The element types which a Lua array table can hold for a container argument or
+ * result: numbers, enums, booleans, strings, and pointers to classes defined with
+ * class_luadef.
+ */
+template<typename E>
+struct is_table_element : public std::integral_constant<bool,
+    std::is_arithmetic<E>::value
+ || std::is_enum<E>::value
+ || std::is_same<E,const char*>::value
+ || is_string_class<E>::value
+ || (std::is_pointer<E>::value && std::is_class<typename std::remove_pointer<E>::type>::value)>
+{
+};
+
+
+/**
+ * The containers which are converted to and from Lua array tables, as a whole, in one
+ * loop. std::vector<bool> is left out, since it has no bool& to hand out.
+ */
+template<typename C>
+struct is_table_container : public std::false_type
+{
+};
+
+template<typename E>
+struct is_table_container<std::vector<E>> : public std::integral_constant<bool,
+    is_table_element<E>::value && !std::is_same<E,bool>::value>
+{
+};
+
+template<typename E, size_t N>
+struct is_table_container<std::array<E,N>> : public is_table_element<E>
+{
+};
+
+
+inline size_t table_length(lua_State* L, int idx)
+{
+#if LUA_VERSION_NUM >= 502
+    return lua_rawlen(L,idx);
+#else
+    return lua_objlen(L,idx);
+#endif
+}
+
+
+//raises the error for element i (from 1) of the table argument at idx
+inline void element_error(lua_State* L, int idx, size_t i, const char* expected)
+{
+    luaL_error(L,"bad argument #%d (%s expected at index %d, got %s)",
+        idx,expected,(int)i,luaL_typename(L,-1));
+}
+
+
+//strings of table elements, which point in to the Lua strings
+template<typename E>
+typename std::enable_if<std::is_same<E,const char*>::value,E>::type
+make_element(const char* str, size_t)
+{
+    return str;
+}
+
+template<typename E>
+typename std::enable_if<is_string_class<E>::value,E>::type
+make_element(const char* str, size_t len)
+{
+    return E(str,len);
+}
+
+
+/**
+ * Reads the value on top of the stack as element i of the table argument at idx. The
+ * table is still on the stack, so the strings in it stay valid for the call.
+ */
+template<typename E>
+typename std::enable_if<std::is_same<E,bool>::value,E>::type
+table_element(lua_State* L, int idx, size_t i)
+{
+    if(lua_type(L,-1) == LUA_TBOOLEAN)
+        return lua_toboolean(L,-1) != 0;
+    if(lua_type(L,-1) != LUA_TNUMBER)
+        element_error(L,idx,i,"boolean");
+    return lua_tonumber(L,-1) != 0;
+}
+
+template<typename E>
+typename std::enable_if<std::is_floating_point<E>::value,E>::type
+table_element(lua_State* L, int idx, size_t i)
+{
+    if(!lua_isnumber(L,-1))
+        element_error(L,idx,i,"number");
+    return static_cast<E>(lua_tonumber(L,-1));
+}
+
+template<typename E>
+typename std::enable_if<std::is_integral<E>::value && !std::is_same<E,bool>::value,E>::type
+table_element(lua_State* L, int idx, size_t i)
+{
+    if(!lua_isnumber(L,-1))
+        element_error(L,idx,i,"number");
+    return to_integer<E>(L,-1);
+}
+
+template<typename E>
+typename std::enable_if<std::is_enum<E>::value,E>::type
+table_element(lua_State* L, int idx, size_t i)
+{
+    if(!lua_isnumber(L,-1))
+        element_error(L,idx,i,"number");
+    return static_cast<E>(to_integer<typename std::underlying_type<E>::type>(L,-1));
+}
+
+template<typename E>
+typename std::enable_if<std::is_same<E,std::string>::value,E>::type
+table_element(lua_State* L, int idx, size_t i)
+{
+    if(!lua_isstring(L,-1))
+        element_error(L,idx,i,"string");
+    size_t len = 0;
+    const char* str = lua_tolstring(L,-1,&len);
+    return make_element<E>(str,len);
+}
+
+//a number would only be converted in the copy on top of the stack, which is popped
+//before the call, so elements which point in to the string have to be strings already
+template<typename E>
+typename std::enable_if<std::is_same<E,const char*>::value
+                    || (is_string_class<E>::value && !std::is_same<E,std::string>::value),E>::type
+table_element(lua_State* L, int idx, size_t i)
+{
+    if(lua_type(L,-1) != LUA_TSTRING)
+        element_error(L,idx,i,"string");
+    size_t len = 0;
+    const char* str = lua_tolstring(L,-1,&len);
+    return make_element<E>(str,len);
+}
+
+template<typename E, typename T = typename std::remove_pointer<E>::type>
+typename std::enable_if<std::is_pointer<E>::value && std::is_class<T>::value,E>::type
+table_element(lua_State* L, int idx, size_t i)
+{
+    if(lua_isnil(L,-1))
+        return NULL;
+    T* obj = class_luarep<typename std::remove_cv<T>::type>::check(L,-1);
+    if(obj == NULL)
+        element_error(L,idx,i,class_luarep<typename std::remove_cv<T>::type>::context(L) != nullptr
+            ? class_luarep<typename std::remove_cv<T>::type>::context(L)->class_name.c_str() : "object");
+    return obj;
+}
+
+
+/**
+ * Pushes one element of a container result
+ */
+inline void push_element(lua_State* L, bool v, bool)
+{
+    lua_pushboolean(L,v ? 1 : 0);
+}
+
+inline void push_element(lua_State* L, const char* v, bool)
+{
+    lua_pushstring(L,v);
+}
+
+template<typename E>
+typename std::enable_if<std::is_floating_point<E>::value>::type
+push_element(lua_State* L, E v, bool)
+{
+    lua_pushnumber(L,static_cast<lua_Number>(v));
+}
+
+template<typename E>
+typename std::enable_if<std::is_integral<E>::value && !std::is_same<E,bool>::value>::type
+push_element(lua_State* L, E v, bool)
+{
+    push_integer(L,v);
+}
+
+template<typename E>
+typename std::enable_if<std::is_enum<E>::value>::type
+push_element(lua_State* L, E v, bool)
+{
+    push_integer(L,static_cast<typename std::underlying_type<E>::type>(v));
+}
+
+template<typename E>
+typename std::enable_if<is_string_class<E>::value>::type
+push_element(lua_State* L, const E& v, bool)
+{
+    lua_pushlstring(L,v.data(),v.size());
+}
+
+template<typename T>
+typename std::enable_if<std::is_class<T>::value>::type
+push_element(lua_State* L, T* v, bool gc)
+{
+    class_luarep<typename std::remove_cv<T>::type>::push(L,const_cast<typename std::remove_cv<T>::type*>(v),gc);
+}
+
+
+/**
+ * Makes a container from the Lua array table at idx, with one pass over the table.
+ */
+template<typename E>
+std::vector<E> table_to_container(lua_State* L, int idx, std::vector<E>*)
+{
+    size_t n = table_length(L,idx);
+    std::vector<E> out;
+    out.reserve(n);
+    for(size_t i = 1; i <= n; ++i)
+    {
+        lua_rawgeti(L,idx,(int)i);
+        out.push_back(table_element<E>(L,idx,i));
+        lua_pop(L,1);
+    }
+    return out;
+}
+
+template<typename E, size_t N>
+std::array<E,N> table_to_container(lua_State* L, int idx, std::array<E,N>*)
+{
+    size_t n = table_length(L,idx);
+    if(n != N)
+        luaL_error(L,"bad argument #%d (table of %d elements expected, got %d)",idx,(int)N,(int)n);
+    std::array<E,N> out;
+    for(size_t i = 1; i <= N; ++i)
+    {
+        lua_rawgeti(L,idx,(int)i);
+        out[i-1] = table_element<E>(L,idx,i);
+        lua_pop(L,1);
+    }
+    return out;
+}
+
+
+/**
+ * Pushes a container as a new Lua array table, sized for it up front. Pointers are
+ * pushed with gc, from the policy of the function.
+ */
+template<typename C>
+void container_to_table(lua_State* L, const C& c, bool gc)
+{
+    lua_createtable(L,(int)c.size(),0);
+    int i = 0;
+    for(auto const& elem : c)
+    {
+        push_element(L,elem,gc);
+        lua_rawseti(L,-2,++i);
+    }
+}
+
+
+/**
+ * Reads a container argument: a Lua table is converted, and a userdata of the container
+ * type (if it was defined with class_luadef, like with stl::expose_genericvector) is
+ * copied, like any other class argument taken by value.
+ */
+template<typename C>
+C check_container(lua_State* L, int idx)
+{
+    if(lua_istable(L,idx))
+        return table_to_container(L,idx,(C*)nullptr);
+    return *class_luarep<C>::check_arg(L,idx);
+}
+
+
+/**
+ * What a const C& container argument is held as until the call. A table is converted in
+ * to storage, and a userdata of the container type is referred to without a copy.
+ */
+template<typename C>
+class container_arg
+{
+public:
+    container_arg(lua_State* L, int idx) : bound(nullptr)
+    {
+        if(lua_istable(L,idx))
+            storage = table_to_container(L,idx,(C*)nullptr);
+        else
+            bound = class_luarep<C>::check_arg(L,idx);
+    }
+
+    operator const C&() const
+    {
+        return bound != nullptr ? *bound : storage;
+    }
+
+private:
+    C storage;
+    const C* bound;     //nullptr when storage is used, so moving this is fine
+};
+
+}
+}
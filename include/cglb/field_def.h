@@ -0,0 +1,173 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "lua_include.h"
+#include "class_luarep.h"
+#include "member_accessor.h"
+#include "integer_interop.h"
+#include <type_traits>
+#include <cstddef>
+
+namespace cglb {
+namespace detail {
+
+
+/**
+ * The types of member data which are read and written by offset, rather than through
+ * a memdat_def. field_none is everything else (classes, pointers, strings, const
+ * members, char), which still gets a memdat_def.
+ */
+enum field_type
+{
+    field_none = 0,
+    field_bool,
+    field_schar,
+    field_uchar,
+    field_short,
+    field_ushort,
+    field_int,
+    field_uint,
+    field_long,
+    field_ulong,
+    field_llong,
+    field_ullong,
+    field_float,
+    field_double
+};
+
+
+template<typename T, typename Enable = void>
+struct field_type_of : public std::integral_constant<unsigned char,field_none> {};
+
+template<> struct field_type_of<bool>               : public std::integral_constant<unsigned char,field_bool> {};
+template<> struct field_type_of<signed char>        : public std::integral_constant<unsigned char,field_schar> {};
+template<> struct field_type_of<unsigned char>      : public std::integral_constant<unsigned char,field_uchar> {};
+template<> struct field_type_of<short>              : public std::integral_constant<unsigned char,field_short> {};
+template<> struct field_type_of<unsigned short>     : public std::integral_constant<unsigned char,field_ushort> {};
+template<> struct field_type_of<int>                : public std::integral_constant<unsigned char,field_int> {};
+template<> struct field_type_of<unsigned int>       : public std::integral_constant<unsigned char,field_uint> {};
+template<> struct field_type_of<long>               : public std::integral_constant<unsigned char,field_long> {};
+template<> struct field_type_of<unsigned long>      : public std::integral_constant<unsigned char,field_ulong> {};
+template<> struct field_type_of<long long>          : public std::integral_constant<unsigned char,field_llong> {};
+template<> struct field_type_of<unsigned long long> : public std::integral_constant<unsigned char,field_ullong> {};
+template<> struct field_type_of<float>              : public std::integral_constant<unsigned char,field_float> {};
+template<> struct field_type_of<double>             : public std::integral_constant<unsigned char,field_double> {};
+
+//enums are stored as their underlying type
+template<typename T>
+struct field_type_of<T, typename std::enable_if<std::is_enum<T>::value>::type>
+    : public field_type_of<typename std::underlying_type<T>::type>
+{
+};
+
+
+/**
+ * The offset of a member data in its class. Like type_record::add_base, only the
+ * address is used, nothing is constructed.
+ */
+template<typename OwnerT, typename DatT>
+std::size_t field_offset(DatT OwnerT::* memdat)
+{
+    typename std::aligned_storage<sizeof(OwnerT), std::alignment_of<OwnerT>::value>::type probe;
+    OwnerT* obj = reinterpret_cast<OwnerT*>(&probe);
+    return reinterpret_cast<const char*>(&(obj->*memdat)) - reinterpret_cast<const char*>(obj);
+}
+
+
+/**
+ * The getter and setter of every field of OwnerT. def is the member_accessor of the
+ * field, which has the offset and the field_type in it, so there is one of each per
+ * class rather than one per member data.
+ */
+template<typename OwnerT>
+struct field_def
+{
+    /**
+     * Index 1 is the object, and index 2 is the key (which isn't used)
+     */
+    static int Get(lua_State* L, void* def)
+    {
+        const member_accessor* field = static_cast<const member_accessor*>(def);
+        OwnerT* obj = class_luarep<OwnerT>::check(L,1);
+        if(!obj)
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+
+        const char* at = reinterpret_cast<const char*>(obj) + field->offset;
+        switch(field->field)
+        {
+        case field_bool:    lua_pushboolean(L,read<bool>(at) ? 1 : 0);    break;
+        case field_schar:   push_integer(L,read<signed char>(at));          break;
+        case field_uchar:   push_integer(L,read<unsigned char>(at));        break;
+        case field_short:   push_integer(L,read<short>(at));                break;
+        case field_ushort:  push_integer(L,read<unsigned short>(at));       break;
+        case field_int:     push_integer(L,read<int>(at));                  break;
+        case field_uint:    push_integer(L,read<unsigned int>(at));         break;
+        case field_long:    push_integer(L,read<long>(at));                 break;
+        case field_ulong:   push_integer(L,read<unsigned long>(at));        break;
+        case field_llong:   push_integer(L,read<long long>(at));            break;
+        case field_ullong:  push_integer(L,read<unsigned long long>(at));   break;
+        case field_float:   lua_pushnumber(L,read<float>(at));              break;
+        case field_double:  lua_pushnumber(L,read<double>(at));             break;
+        default:            lua_pushnil(L);                                 break;
+        }
+        return 1;
+    }
+
+    /**
+     * Index 1 is the object, and index 2 is the value
+     */
+    static int Set(lua_State* L, void* def)
+    {
+        const member_accessor* field = static_cast<const member_accessor*>(def);
+        OwnerT* obj = class_luarep<OwnerT>::check(L,1);
+        if(!obj)
+            return 0;
+
+        char* at = reinterpret_cast<char*>(obj) + field->offset;
+        if(field->field == field_bool)
+        {
+            //booleans, or numbers like the bool arguments of functions
+            write<bool>(at,lua_isboolean(L,2) ? lua_toboolean(L,2) != 0 : luaL_checkint(L,2) != 0);
+            return 0;
+        }
+
+        switch(field->field)
+        {
+        case field_schar:   write<signed char>(at,check_integer<signed char>(L,2));                 break;
+        case field_uchar:   write<unsigned char>(at,check_integer<unsigned char>(L,2));             break;
+        case field_short:   write<short>(at,check_integer<short>(L,2));                             break;
+        case field_ushort:  write<unsigned short>(at,check_integer<unsigned short>(L,2));           break;
+        case field_int:     write<int>(at,check_integer<int>(L,2));                                 break;
+        case field_uint:    write<unsigned int>(at,check_integer<unsigned int>(L,2));               break;
+        case field_long:    write<long>(at,check_integer<long>(L,2));                               break;
+        case field_ulong:   write<unsigned long>(at,check_integer<unsigned long>(L,2));             break;
+        case field_llong:   write<long long>(at,check_integer<long long>(L,2));                     break;
+        case field_ullong:  write<unsigned long long>(at,check_integer<unsigned long long>(L,2));   break;
+        case field_float:   write<float>(at,luaL_checknumber(L,2));                                 break;
+        case field_double:  write<double>(at,luaL_checknumber(L,2));                                break;
+        default:                                                break;
+        }
+        return 0;
+    }
+
+private:
+    template<typename DatT>
+    static DatT read(const char* at)
+    {
+        return *reinterpret_cast<const DatT*>(at);
+    }
+
+    template<typename DatT, typename ValT>
+    static void write(char* at, ValT val)
+    {
+        *reinterpret_cast<DatT*>(at) = static_cast<DatT>(val);
+    }
+};
+
+}
+}
@@ -10,6 +10,8 @@
 #include "lua_include.h"
 #include <type_traits>
 #include <typeinfo>
+#include <new>
+#include <utility>
 
 namespace cglb {
     
@@ -30,9 +32,18 @@ struct function_def
       * The upvalue at index 1 is an instance of this class
       */
     static int LuaFunction(lua_State* L)
+    {
+        return Invoke(L,lua_touserdata(L,lua_upvalueindex(1)));
+    }
+
+    /**
+      * Same as LuaFunction, with the instance of this class given as def. This is
+      * what __index calls for getters, see member_accessor.
+      */
+    static int Invoke(lua_State* L, void* def)
     {
         typedef function_def<traits,FnPtrT,policy> ThisT;
-        ThisT* self = (ThisT*)lua_touserdata(L,lua_upvalueindex(1));
+        ThisT* self = (ThisT*)def;
         
         return detail::GatherArgs<traits::arity + 1>::template Gather<FnPtrT,traits,policy>(L,self->fnptr);
     }
@@ -41,6 +52,113 @@ struct function_def
 
 
 
+/**
+ * Used for lambdas (with captures) and std::function. The callable is moved in to a
+ * full userdata which is the upvalue of the closure, so it is reached without any
+ * lookup and lives exactly as long as the closure, and its destructor is run by __gc
+ * (also during lua_close). Nothing is kept in registered_functions for it.
+ *
+ * Like a function pointer which is not a member function, its arguments start at
+ * index 1, which is the object for obj:fn(...).
+ */
+template <typename traits, typename F, typename policy>
+struct callable_def
+{
+    /**
+     * Pushes the closure for f
+     */
+    static void Push(lua_State* L, F&& f)
+    {
+        void* block = lua_newuserdata(L,sizeof(F));
+        new (block) F(std::move(f));
+        //nothing to run for callables without a destructor, such as lambdas which
+        //only capture numbers and pointers
+        if(!std::is_trivially_destructible<F>::value)
+        {
+            PushMetatable(L);
+            lua_setmetatable(L,-2);
+        }
+        lua_pushcclosure(L,&LuaFunction,1);
+        detail::WrapAwaitable<typename traits::result_type>(L);
+    }
+
+    /**
+      * The upvalue at index 1 is the callable
+      */
+    static int LuaFunction(lua_State* L)
+    {
+        return Invoke(L,lua_touserdata(L,lua_upvalueindex(1)));
+    }
+
+    static int Invoke(lua_State* L, void* def)
+    {
+        F* self = static_cast<F*>(def);
+        return detail::GatherArgs<traits::arity + 1>::template Gather<F*,traits,policy>(L,self);
+    }
+
+private:
+    static int Destroy(lua_State* L)
+    {
+        F* self = static_cast<F*>(lua_touserdata(L,1));
+        if(self != nullptr)
+            self->~F();
+        return 0;
+    }
+
+    //one metatable for every callable of type F in a state, kept in the registry
+    static void PushMetatable(lua_State* L)
+    {
+        lua_pushlightuserdata(L,registry_key());            //[1] = key
+        lua_rawget(L,LUA_REGISTRYINDEX);                    //[1] = registry[key]
+        if(!lua_isnil(L,-1))
+            return;
+        lua_pop(L,1);                                       //pop[1]
+        lua_createtable(L,0,1);                             //[1] = metatable
+        lua_pushcfunction(L,&Destroy);                      //[2] = Destroy
+        lua_setfield(L,-2,"__gc");                          //[1].__gc = [2]            -> pop[2]
+        lua_pushlightuserdata(L,registry_key());            //[2] = key
+        lua_pushvalue(L,-2);                                //[3] = [1]
+        lua_rawset(L,LUA_REGISTRYINDEX);                    //registry[key] = [1]       -> pop[3,2]
+    }
+
+    static void* registry_key()
+    {
+        static char key = 0;
+        return &key;
+    }
+};
+
+
+
+/**
+ * Used for class_luadef<T>::constructor<Args...>. The new object is made with
+ * class_luarep<T>::emplace, so that it uses the allocation strategy of T in the
+ * lua_State, and is left on the stack as the result.
+ */
+template<typename T, typename... Args>
+struct constructor_def
+{
+    //Called by FunctionCall as if it were a pointer to a void(Args...) function
+    struct emplacer
+    {
+        lua_State* L;
+        void operator()(Args... a) const
+        {
+            class_luarep<T>::emplace(L,std::forward<Args>(a)...);
+        }
+    };
+
+    static int LuaFunction(lua_State* L)
+    {
+        typedef function_traits<void(*)(Args...)> traits;
+        emplacer e = { L };
+        detail::GatherArgs<traits::arity + 1>::template Gather<emplacer*,traits,policy_return_gc>(L,&e);
+        return 1;
+    }
+};
+
+
+
 template<typename T, typename policy, typename FnPtrT>
 struct custom_function_def;
 
@@ -62,9 +180,14 @@ struct custom_function_def<T,policy,int (*)(lua_State*,T*)>
     StrictFnPtrT fnptr;
 
     static int LuaFunction(lua_State* L)
+    {
+        return Invoke(L,lua_touserdata(L,lua_upvalueindex(1)));
+    }
+
+    static int Invoke(lua_State* L, void* def)
     {
         typedef custom_function_def<T,policy,StrictFnPtrT> ThisT;
-        ThisT* self = (ThisT*)lua_touserdata(L,lua_upvalueindex(1));
+        ThisT* self = (ThisT*)def;
         T* obj = class_luarep<T>::check(L,1);
         return (*(self->fnptr))(L,obj);
     }
@@ -89,9 +212,14 @@ struct custom_function_def<T,policy,int (*)(lua_State*)>
     StrictFnPtr fnptr;
 
     static int LuaFunction(lua_State* L)
+    {
+        return Invoke(L,lua_touserdata(L,lua_upvalueindex(1)));
+    }
+
+    static int Invoke(lua_State* L, void* def)
     {
         typedef custom_function_def<T,policy,StrictFnPtr> ThisT;
-        ThisT* self = (ThisT*)lua_touserdata(L,lua_upvalueindex(1));
+        ThisT* self = (ThisT*)def;
         return (*(self->fnptr))(L);
     }
 };
@@ -0,0 +1,279 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "lua_include.h"
+#include "cglb_config.h"
+#include <type_traits>
+#include <limits>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+
+namespace cglb {
+namespace detail {
+
+
+/**
+ * Integers which have more bits than a lua_Number can hold exactly, which are the
+ * 64 bit integers for the usual double lua_Number
+ */
+template<typename T>
+struct is_wide_integer : public std::integral_constant<bool,
+    (std::numeric_limits<T>::digits > std::numeric_limits<lua_Number>::digits)>
+{
+};
+
+
+/**
+ * Integers which lua_Integer can hold (lua_Integer is only 32 bits for Lua 5.1
+ * on 32 bit platforms)
+ */
+template<typename T>
+struct fits_lua_integer : public std::integral_constant<bool,
+    (std::numeric_limits<T>::digits <= std::numeric_limits<lua_Integer>::digits)>
+{
+};
+
+
+//Lua 5.3 and later have 64 bit integers, so nothing is wide for them
+#if LUA_VERSION_NUM >= 503
+#define CGLB_LUA_HAS_INT64 1
+#else
+#define CGLB_LUA_HAS_INT64 0
+#endif
+
+
+/**
+ * Integers which are pushed with lua_pushinteger and read with lua_tointeger
+ */
+template<typename T>
+struct uses_lua_integer : public std::integral_constant<bool,
+    (fits_lua_integer<T>::value && !is_wide_integer<T>::value)
+ || (CGLB_LUA_HAS_INT64 && is_wide_integer<T>::value)>
+{
+};
+
+
+/**
+ * Parses a string made by push_integer for a wide integer. Returns false if the
+ * whole string is not a number which fits in T.
+ */
+template<typename T>
+bool parse_integer(const char* str, T& out)
+{
+    char* end = nullptr;
+    errno = 0;
+    if(std::is_signed<T>::value)
+    {
+        long long v = std::strtoll(str,&end,10);
+        if(errno != 0 || end == str || *end != '\0'
+        || v < (long long)std::numeric_limits<T>::min() || v > (long long)std::numeric_limits<T>::max())
+            return false;
+        out = static_cast<T>(v);
+    }
+    else
+    {
+        if(*str == '-')
+            return false;
+        unsigned long long v = std::strtoull(str,&end,10);
+        if(errno != 0 || end == str || *end != '\0' || v > (unsigned long long)std::numeric_limits<T>::max())
+            return false;
+        out = static_cast<T>(v);
+    }
+    return true;
+}
+
+
+/**
+ * If wide integers which a lua_Number cannot hold exactly are pushed as strings, from
+ * CGLB_INT64_AS_STRING. The wide functions below take it as a tag, so that both ways
+ * are there to be used directly.
+ */
+typedef std::integral_constant<bool, (CGLB_INT64_AS_STRING != 0)> int64_as_string;
+
+
+/**
+ * True if v is in the range of integers a lua_Number holds every one of, which is
+ * +-2^53 for a double. Past that, a number may be the rounded value of another integer.
+ */
+template<typename T>
+bool in_exact_range(T v)
+{
+    const T exact = (T)1 << std::numeric_limits<lua_Number>::digits;
+    return v <= exact && (!std::is_signed<T>::value || v >= (T)0 - exact);
+}
+
+inline bool number_in_exact_range(lua_Number n)
+{
+    const lua_Number exact = (lua_Number)(1ULL << std::numeric_limits<lua_Number>::digits);
+    return n <= exact && n >= -exact;
+}
+
+
+/**
+ * Writes v in decimal, the form parse_integer reads
+ */
+template<typename T>
+void format_integer(char* buff, size_t size, T v)
+{
+    if(std::is_signed<T>::value)
+        snprintf(buff,size,"%lld",(long long)v);
+    else
+        snprintf(buff,size,"%llu",(unsigned long long)v);
+}
+
+
+/**
+ * Pushes a wide integer as a decimal string if a lua_Number cannot hold it exactly
+ */
+template<typename T>
+void push_wide_integer(lua_State* L, T v, std::true_type)
+{
+    if(in_exact_range(v))
+    {
+        lua_pushnumber(L,static_cast<lua_Number>(v));
+        return;
+    }
+    char buff[32];
+    format_integer(buff,sizeof(buff),v);
+    lua_pushstring(L,buff);
+}
+
+/**
+ * Pushes a wide integer as a number, raising a Lua error rather than rounding it
+ */
+template<typename T>
+void push_wide_integer(lua_State* L, T v, std::false_type)
+{
+    if(!in_exact_range(v))
+    {
+        char buff[32];
+        format_integer(buff,sizeof(buff),v);
+        luaL_error(L,"integer %s cannot be held exactly by a number (see CGLB_INT64_AS_STRING)",buff);
+    }
+    lua_pushnumber(L,static_cast<lua_Number>(v));
+}
+
+
+/**
+ * Reads a wide integer argument, which is either a number in the exact range of a
+ * lua_Number, or (with the tag true_type) a string made by push_wide_integer. Anything
+ * else raises a Lua argument error.
+ */
+template<typename T>
+T check_wide_integer(lua_State* L, int idx, std::false_type)
+{
+    lua_Number n = luaL_checknumber(L,idx);
+    if(!number_in_exact_range(n) || (!std::is_signed<T>::value && n < 0))
+        luaL_argerror(L,idx,"integer in the exact range of a number expected");
+    return static_cast<T>(n);
+}
+
+template<typename T>
+T check_wide_integer(lua_State* L, int idx, std::true_type)
+{
+    if(lua_type(L,idx) == LUA_TSTRING)
+    {
+        T v = 0;
+        if(!parse_integer(lua_tostring(L,idx),v))
+            luaL_argerror(L,idx,"integer expected");
+        return v;
+    }
+    return check_wide_integer<T>(L,idx,std::false_type());
+}
+
+
+/**
+ * Pushes an integer of type T. Integers which lua_Integer holds are pushed with
+ * lua_pushinteger, so they stay integers in Lua 5.3 and later.
+ *
+ * For Lua 5.1 and LuaJIT, wide integers which a lua_Number cannot hold exactly are
+ * pushed as decimal strings if CGLB_INT64_AS_STRING is on, and raise a Lua error if
+ * it is off, so they are never rounded.
+ */
+template<typename T>
+typename std::enable_if<uses_lua_integer<T>::value>::type
+push_integer(lua_State* L, T v)
+{
+    lua_pushinteger(L,static_cast<lua_Integer>(v));
+}
+
+template<typename T>
+typename std::enable_if<!uses_lua_integer<T>::value && !is_wide_integer<T>::value>::type
+push_integer(lua_State* L, T v)
+{
+    lua_pushnumber(L,static_cast<lua_Number>(v));
+}
+
+template<typename T>
+typename std::enable_if<!uses_lua_integer<T>::value && is_wide_integer<T>::value>::type
+push_integer(lua_State* L, T v)
+{
+    push_wide_integer(L,v,int64_as_string());
+}
+
+
+/**
+ * Reads an integer argument of type T, raising a Lua argument error if it is not
+ * a number. Wide integers also accept the strings push_integer makes for them, and
+ * raise for numbers past the range a lua_Number holds exactly.
+ */
+template<typename T>
+typename std::enable_if<uses_lua_integer<T>::value,T>::type
+check_integer(lua_State* L, int idx)
+{
+    return static_cast<T>(luaL_checkinteger(L,idx));
+}
+
+template<typename T>
+typename std::enable_if<!uses_lua_integer<T>::value && !is_wide_integer<T>::value,T>::type
+check_integer(lua_State* L, int idx)
+{
+    return static_cast<T>(luaL_checknumber(L,idx));
+}
+
+template<typename T>
+typename std::enable_if<!uses_lua_integer<T>::value && is_wide_integer<T>::value,T>::type
+check_integer(lua_State* L, int idx)
+{
+    return check_wide_integer<T>(L,idx,int64_as_string());
+}
+
+
+/**
+ * Same as check_integer, but without checking the type of the value, which gives 0
+ * for things that are not numbers. Used by unchecked_args.
+ */
+template<typename T>
+typename std::enable_if<uses_lua_integer<T>::value,T>::type
+to_integer(lua_State* L, int idx)
+{
+    return static_cast<T>(lua_tointeger(L,idx));
+}
+
+template<typename T>
+typename std::enable_if<!uses_lua_integer<T>::value && !is_wide_integer<T>::value,T>::type
+to_integer(lua_State* L, int idx)
+{
+    return static_cast<T>(lua_tonumber(L,idx));
+}
+
+template<typename T>
+typename std::enable_if<!uses_lua_integer<T>::value && is_wide_integer<T>::value,T>::type
+to_integer(lua_State* L, int idx)
+{
+#if CGLB_INT64_AS_STRING
+    if(lua_type(L,idx) == LUA_TSTRING)
+    {
+        T v = 0;
+        parse_integer(lua_tostring(L,idx),v);
+        return v;
+    }
+#endif
+    return static_cast<T>(lua_tonumber(L,idx));
+}
+
+}
+}
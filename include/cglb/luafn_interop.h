@@ -2,22 +2,93 @@
 #include "function_traits.h"
 #include "class_luarep.h"
 #include "lua_include.h"
+#include "integer_interop.h"
+#include "string_ref.h"
+#include "container_interop.h"
+#include "async_executor.h"
 #include <type_traits>
+#include <tuple>
+#include <utility>
+#include <future>
+#include <chrono>
+#include <memory>
+#include <exception>
+#include <cmath>
 
 namespace cglb {
 namespace detail {
 
 
+    /**
+     * A list of the indices of a tuple, to expand it in to the arguments of a function
+     * or in to several results (C++11 has no std::index_sequence)
+     */
+    template<size_t... I>
+    struct index_list
+    {
+    };
+
+    template<size_t N, size_t... I>
+    struct make_index_list : public make_index_list<N-1,N-1,I...>
+    {
+    };
+
+    template<size_t... I>
+    struct make_index_list<0,I...>
+    {
+        typedef index_list<I...> type;
+    };
+
+
+
+    /**
+     * std::tuple and std::pair results, which are pushed as one Lua value per element
+     */
+    template<typename T>
+    struct is_tuple_like : public std::false_type
+    {
+    };
+
+    template<typename... Elems>
+    struct is_tuple_like<std::tuple<Elems...>> : public std::true_type
+    {
+    };
+
+    template<typename First, typename Second>
+    struct is_tuple_like<std::pair<First,Second>> : public std::true_type
+    {
+    };
+
+
+    /**
+     * Results which are waited for by yielding the calling coroutine, see AwaitResult.
+     * type is what the future gives.
+     */
+    template<typename T>
+    struct is_awaitable : public std::false_type
+    {
+    };
+
+    template<typename R>
+    struct is_awaitable<std::future<R>> : public std::true_type
+    {
+        typedef R type;
+    };
+
+    template<typename R>
+    struct is_awaitable<std::shared_future<R>> : public std::true_type
+    {
+        typedef R type;
+    };
+
+
     template<typename T
         , typename strippedT = typename std::decay< 
             typename std::remove_reference<T>::type 
         >::type>
-    //since lua handles all numbers the same way, we just need to check if it
-    //is an integral or floating point type. 
+    //floating point types are plain lua_Numbers
     static typename std::enable_if<
-        (std::is_arithmetic<strippedT>::value
-     ||  std::is_enum<strippedT>::value)
-     && !std::is_same<strippedT,bool>::value,
+        std::is_floating_point<strippedT>::value,
     strippedT >::type
     GetFuncArg(lua_State* L, int idx)
     {
@@ -25,15 +96,48 @@ namespace detail {
     }
 
 
+    template<typename T
+        , typename strippedT = typename std::decay< 
+            typename std::remove_reference<T>::type 
+        >::type>
+    //integers use the integer accessors, and 64 bit integers are not rounded (see
+    //integer_interop.h)
+    static typename std::enable_if<
+        std::is_integral<strippedT>::value
+     && !std::is_same<strippedT,bool>::value,
+    strippedT >::type
+    GetFuncArg(lua_State* L, int idx)
+    {
+        return check_integer<strippedT>(L,idx);
+    }
+
+
+    template<typename T
+        , typename strippedT = typename std::decay< 
+            typename std::remove_reference<T>::type 
+        >::type>
+    //enums are read as their underlying type
+    static typename std::enable_if<
+        std::is_enum<strippedT>::value,
+    strippedT >::type
+    GetFuncArg(lua_State* L, int idx)
+    {
+        return static_cast<strippedT>(check_integer<typename std::underlying_type<strippedT>::type>(L,idx));
+    }
+
+
     template<typename T
         , typename strippedT = typename std::decay<
             typename std::remove_reference<T>::type
         >::type>
     static typename std::enable_if<
         std::is_same<strippedT,bool>::value,
-    T >::type
+    strippedT >::type
     GetFuncArg(lua_State* L, int idx)
     {
+        //booleans, or numbers like before booleans were accepted
+        if(lua_type(L,idx) == LUA_TBOOLEAN)
+            return lua_toboolean(L,idx) != 0;
         return !!luaL_checkint(L,idx);
     }
 
@@ -78,11 +182,13 @@ namespace detail {
     static typename std::enable_if<
             std::is_reference<Tref>::value  
          && std::is_class<T>::value
-         && !std::is_same<T,std::string>::value, //strings are special types for Lua
+         && !is_string_class<T>::value //strings are special types for Lua
+         && !(is_table_container<T>::value && std::is_const<typename std::remove_reference<Tref>::type>::value),
     Tref >::type
     GetFuncArg(lua_State* L, int idx)
     {
-        T* arg = class_luarep<T>::check(L,idx);
+        //a reference cannot be NULL, so raise an error instead
+        T* arg = class_luarep<T>::check_arg(L,idx);
         return *arg; //is this right? Or can you directly pass a pointer as a reference
     }
 
@@ -91,19 +197,45 @@ namespace detail {
     //Handle non-ref function args of a class type
     static typename std::enable_if<!std::is_reference<T>::value  
                               && std::is_class<DecayT>::value
-                              && !std::is_same<DecayT,std::string>::value,
+                              && !is_string_class<DecayT>::value
+                              && !is_table_container<DecayT>::value,
     T >::type
     GetFuncArg(lua_State* L, int idx)
     {
-        T* arg = class_luarep<T>::check(L,idx);
+        DecayT* arg = class_luarep<DecayT>::check_arg(L,idx);
         return *arg; 
     }
 
 
+    template<typename T, typename DecayT = typename std::decay<T>::type>
+    //std::vector and std::array of numbers, strings or object pointers, taken by value,
+    //are made from a Lua array table in one loop (see container_interop.h)
+    static typename std::enable_if<!std::is_reference<T>::value
+                              && is_table_container<DecayT>::value,
+    DecayT >::type
+    GetFuncArg(lua_State* L, int idx)
+    {
+        return check_container<DecayT>(L,idx);
+    }
+
+
+    template<typename Tref
+            , typename T = typename std::decay< typename std::remove_reference<Tref>::type >::type>
+    //the same for const references to them, which refer to the container instead when
+    //it is a userdata of the container type
+    static typename std::enable_if<std::is_reference<Tref>::value
+                              && std::is_const<typename std::remove_reference<Tref>::type>::value
+                              && is_table_container<T>::value,
+    container_arg<T> >::type
+    GetFuncArg(lua_State* L, int idx)
+    {
+        return container_arg<T>(L,idx);
+    }
+
+
     template<typename T>
     //handle strings
-    static typename std::enable_if<std::is_same<const char*,T>::value
-                      || std::is_same<std::string,typename std::decay<T>::type>::value,
+    static typename std::enable_if<std::is_same<const char*,T>::value,
     const char* >::type
     GetFuncArg(lua_State* L, int idx)
     {
@@ -111,20 +243,163 @@ namespace detail {
     }
 
 
+    template<typename T, typename DecayT = typename std::decay<T>::type>
+    //std::string, string_ref and std::string_view are made with the length of the Lua
+    //string, so embedded '\0's are kept, and string_ref and std::string_view point in
+    //to the Lua string without copying it
+    static typename std::enable_if<is_string_class<DecayT>::value,
+    DecayT >::type
+    GetFuncArg(lua_State* L, int idx)
+    {
+        size_t len = 0;
+        const char* str = luaL_checklstring(L,idx,&len);
+        return DecayT(str,len);
+    }
+
+
+    /**
+     * The ToFuncArg overloads are GetFuncArg for unchecked_args, which reads numbers,
+     * booleans, enums and strings with lua_to*. Everything else is still checked.
+     */
+    template<typename T
+        , typename strippedT = typename std::decay< 
+            typename std::remove_reference<T>::type 
+        >::type>
+    static typename std::enable_if<
+        std::is_floating_point<strippedT>::value,
+    strippedT >::type
+    ToFuncArg(lua_State* L, int idx)
+    {
+        return static_cast<strippedT>(lua_tonumber(L,idx));
+    }
+
+
+    template<typename T
+        , typename strippedT = typename std::decay< 
+            typename std::remove_reference<T>::type 
+        >::type>
+    static typename std::enable_if<
+        std::is_integral<strippedT>::value
+     && !std::is_same<strippedT,bool>::value,
+    strippedT >::type
+    ToFuncArg(lua_State* L, int idx)
+    {
+        return to_integer<strippedT>(L,idx);
+    }
+
+
+    template<typename T
+        , typename strippedT = typename std::decay< 
+            typename std::remove_reference<T>::type 
+        >::type>
+    static typename std::enable_if<
+        std::is_enum<strippedT>::value,
+    strippedT >::type
+    ToFuncArg(lua_State* L, int idx)
+    {
+        return static_cast<strippedT>(to_integer<typename std::underlying_type<strippedT>::type>(L,idx));
+    }
+
+
+    template<typename T
+        , typename strippedT = typename std::decay<
+            typename std::remove_reference<T>::type
+        >::type>
+    static typename std::enable_if<
+        std::is_same<strippedT,bool>::value,
+    strippedT >::type
+    ToFuncArg(lua_State* L, int idx)
+    {
+        //booleans, or numbers like GetFuncArg
+        return lua_type(L,idx) == LUA_TBOOLEAN ? lua_toboolean(L,idx) != 0 : lua_tonumber(L,idx) != 0;
+    }
+
+
+    template<typename T>
+    static typename std::enable_if<std::is_same<const char*,T>::value,
+    const char* >::type
+    ToFuncArg(lua_State* L, int idx)
+    {
+        const char* str = lua_tostring(L,idx);
+        return str != nullptr ? str : "";
+    }
+
+
+    template<typename T, typename DecayT = typename std::decay<T>::type>
+    static typename std::enable_if<is_string_class<DecayT>::value,
+    DecayT >::type
+    ToFuncArg(lua_State* L, int idx)
+    {
+        size_t len = 0;
+        const char* str = lua_tolstring(L,idx,&len);
+        return str != nullptr ? DecayT(str,len) : DecayT("",0);
+    }
+
+
+    template<typename T
+        , typename strippedT = typename std::decay< 
+            typename std::remove_reference<T>::type 
+        >::type>
+    //class types and pointers are checked the same as always
+    static typename std::enable_if<
+        !std::is_arithmetic<strippedT>::value
+     && !std::is_enum<strippedT>::value
+     && !std::is_same<const char*,T>::value
+     && !is_string_class<strippedT>::value,
+    decltype(GetFuncArg<T>(nullptr,0)) >::type
+    ToFuncArg(lua_State* L, int idx)
+    {
+        return GetFuncArg<T>(L,idx);
+    }
+
+
+    /**
+     * Picks GetFuncArg or ToFuncArg for the unchecked_args of pol
+     */
+    template<typename T, typename pol>
+    static typename std::enable_if<!pol::UncheckedArgs,decltype(GetFuncArg<T>(nullptr,0))>::type
+    FetchFuncArg(lua_State* L, int idx)
+    {
+        return GetFuncArg<T>(L,idx);
+    }
+
+
+    template<typename T, typename pol>
+    static typename std::enable_if<pol::UncheckedArgs,decltype(ToFuncArg<T>(nullptr,0))>::type
+    FetchFuncArg(lua_State* L, int idx)
+    {
+        return ToFuncArg<T>(L,idx);
+    }
+
+
     
 
 
-    template<typename T, typename pol
-        , typename RmPtrT = typename std::decay< typename std::remove_pointer<T>::type >::type>
+    template<typename T, typename pol, typename DecayT = typename std::decay<T>::type>
+    static typename std::enable_if<std::is_floating_point<DecayT>::value>::type
+    PushFuncResult(lua_State* L, T res)
+    {
+        lua_pushnumber(L,lua_Number(res));
+    }
+
+
+    template<typename T, typename pol, typename DecayT = typename std::decay<T>::type>
     static typename std::enable_if<
-        (std::is_arithmetic<RmPtrT>::value 
-        && !std::is_same<bool,T>::value
-        && !std::is_same<char,RmPtrT>::value)
-        || std::is_enum<T>::value
+        std::is_integral<DecayT>::value
+        && !std::is_same<bool,DecayT>::value
+        && !std::is_same<char,DecayT>::value
     >::type
     PushFuncResult(lua_State* L, T res)
     {
-        lua_pushnumber(L,lua_Number(res));
+        push_integer<DecayT>(L,res);
+    }
+
+
+    template<typename T, typename pol, typename DecayT = typename std::decay<T>::type>
+    static typename std::enable_if<std::is_enum<DecayT>::value>::type
+    PushFuncResult(lua_State* L, T res)
+    {
+        push_integer(L,static_cast<typename std::underlying_type<DecayT>::type>(res));
     }
 
 
@@ -149,7 +424,9 @@ namespace detail {
     template<typename Tref, typename pol, typename T = typename std::decay<Tref>::type>
     static typename std::enable_if<std::is_reference<Tref>::value 
                               && std::is_class<T>::value
-                              && !std::is_same<T,std::string>::value
+                              && !is_string_class<T>::value
+                              && !is_tuple_like<T>::value
+                              && !is_table_container<T>::value
     >::type
     PushFuncResult(lua_State* L, Tref res)
     {
@@ -158,39 +435,40 @@ namespace detail {
 
 
     //Since it is temporary (pass by value) anyway, the user shouldn't care so much what kind 
-    //of type is passed to lua. However, it is not possible to pass non-pointer types to Lua in 
-    //this library, so make sure that it is copy constructorable
+    //of type is passed to lua. The copy is either stored inline in the userdata or boxed with
+    //new, depending on class_luadef<T>::store_values_inline. The result is moved in to it,
+    //so it only has to be move constructible
     template<typename T, typename pol, typename DecayT = typename std::decay<T>::type>
     //this is a value result with a class type (i.e. non-pod)
     static typename std::enable_if<
             !std::is_reference<T>::value 
          && !std::is_pointer<T>::value
-         &&  std::is_copy_constructible<DecayT>::value
+         &&  std::is_move_constructible<DecayT>::value
          &&  std::is_class<DecayT>::value
-         && !std::is_same<DecayT,std::string>::value
+         && !is_string_class<DecayT>::value
+         && !is_tuple_like<DecayT>::value
+         && !is_table_container<DecayT>::value
+         && !is_awaitable<DecayT>::value
     >::type
     PushFuncResult(lua_State* L, T res)
     {
-        //FIXME: Use the allocation strategy of the user, because of the ability to
-        //use malloc/free rather than new/delete in constructor/destructor of lua_classdef<T>
-        T* resPtr = new T(res);
-        class_luarep<T>::push(L,resPtr,true); //have it be garbage collected
+        class_luarep<DecayT>::emplace(L,std::move(res)); //have it be garbage collected
     }
 
 
     template<typename T, typename pol, typename DecayT = typename std::decay<T>::type>
-    //this is a value result with a class type (i.e. non-pod), which is not copy constructable
+    //this is a value result with a class type (i.e. non-pod), which is not move constructable
     //This probably can't happen, but better safe than sorry
     static typename std::enable_if<!std::is_reference<T>::value 
                                   && !std::is_pointer<T>::value
-                                  && !std::is_copy_constructible<DecayT>::value
+                                  && !std::is_move_constructible<DecayT>::value
                                   && std::is_class<DecayT>::value
     >::type
     PushFuncResult(lua_State* L, T res)
     {
-        static_assert(!std::is_copy_constructible<DecayT>::value,
+        static_assert(std::is_move_constructible<DecayT>::value,
             "Could not push the result of a function on to the Lua stack due to the type not being "
-            "copy constructible. Change it to be a reference or pointer type.");
+            "move constructible. Change it to be a reference or pointer type.");
     }
 
 
@@ -204,117 +482,755 @@ namespace detail {
 
     template<typename T, typename pol>
     static typename std::enable_if<
-        std::is_same<typename std::decay<T>::type,std::string>::value
+        is_string_class<typename std::decay<T>::type>::value
     >::type
     PushFuncResult(lua_State* L, T res)
     {
-        return PushFuncResult<const char*,pol>(L,res.c_str());
+        lua_pushlstring(L,res.data(),res.size());
     }
 
 
+    template<typename T, typename pol, typename DecayT = typename std::decay<T>::type>
+    //a container type which is defined with class_luadef is still pushed as an object
+    static typename std::enable_if<std::is_reference<T>::value>::type
+    PushBoundContainer(lua_State* L, T res)
+    {
+        class_luarep<DecayT>::push(L,(DecayT*)&res,pol::ShouldGC);
+    }
+
+
+    template<typename T, typename pol, typename DecayT = typename std::decay<T>::type>
+    static typename std::enable_if<!std::is_reference<T>::value>::type
+    PushBoundContainer(lua_State* L, T res)
+    {
+        class_luarep<DecayT>::emplace(L,std::move(res));
+    }
+
+
+    template<typename T, typename pol, typename DecayT = typename std::decay<T>::type>
+    //any other std::vector or std::array of numbers, strings or object pointers becomes a
+    //new Lua array table
+    static typename std::enable_if<is_table_container<DecayT>::value>::type
+    PushFuncResult(lua_State* L, T res)
+    {
+        if(class_luarep<DecayT>::context(L) != nullptr)
+            PushBoundContainer<T,pol>(L,std::forward<T>(res));
+        else
+            container_to_table(L,res,pol::ShouldGC);
+    }
+
+
+    template<typename pol, typename TupleRef, size_t... I
+            , typename Tuple = typename std::decay<TupleRef>::type>
+    static void PushTupleResult(lua_State* L, TupleRef&& res, index_list<I...>)
+    {
+        (void)L; //unused for an empty tuple
+        (void)res;
+        //braces, so that the elements are pushed in order
+        const int pushed[] = { 0, (PushFuncResult<typename std::tuple_element<I,Tuple>::type,pol>(
+                                      L,std::get<I>(std::forward<TupleRef>(res))), 0) ... };
+        (void)pushed;
+    }
+
+
+    template<typename T, typename pol, typename DecayT = typename std::decay<T>::type>
+    //every element is its own result, so std::tuple<float,float,float> is three numbers,
+    //with nothing allocated for the tuple
+    static typename std::enable_if<is_tuple_like<DecayT>::value>::type
+    PushFuncResult(lua_State* L, T res)
+    {
+        PushTupleResult<pol>(L,std::forward<T>(res),typename make_index_list<std::tuple_size<DecayT>::value>::type());
+    }
+
+
+
+
+
+
+    /**
+     * What a call to a function returning a future waits on. Shared by the userdata which
+     * the Lua side of the call passes back to AwaitWait (see WrapAwaitClosure), and the
+     * await_task of the executor while the coroutine is waiting.
+     */
+    class await_state
+    {
+    public:
+        await_state() : task(nullptr)
+        {
+        }
+
+        virtual ~await_state()
+        {
+        }
+
+        virtual bool ready() = 0;
+
+        //pushes the results, waiting for them if they are not ready, and returns how many
+        virtual int push(lua_State* L) = 0;
+
+        async_task* task;   //the task in the executor, while there is one
+    };
+
+
+    /**
+     * The await_state of a call which returned the future Fut. The value of the future is
+     * pushed like the result of the function would have been, and an exception stored in
+     * it is pushed as nil and its message.
+     */
+    template<typename Fut, typename pol>
+    class future_state : public await_state
+    {
+    public:
+        typedef typename is_awaitable<Fut>::type R;
+
+        explicit future_state(Fut&& f) : fut(std::move(f))
+        {
+        }
+
+        bool ready() override
+        {
+            return IsReady(fut);
+        }
+
+        int push(lua_State* L) override
+        {
+            return Push(L,fut);
+        }
+
+        //a deferred future is run by get, so it is as ready as it will be
+        static bool IsReady(const Fut& f)
+        {
+            return !f.valid() || f.wait_for(std::chrono::seconds(0)) != std::future_status::timeout;
+        }
+
+        //pushes the value of f, waiting for it if it is not ready
+        static int Push(lua_State* L, Fut& f)
+        {
+            int top = lua_gettop(L);
+            try
+            {
+                PushValue<R>(L,f);
+            }
+            catch(const std::exception& e)
+            {
+                lua_settop(L,top);
+                lua_pushnil(L);
+                lua_pushstring(L,e.what());
+            }
+            return lua_gettop(L) - top;
+        }
+
+    private:
+        template<typename ValT>
+        static typename std::enable_if<std::is_void<ValT>::value>::type
+        PushValue(lua_State*, Fut& f)
+        {
+            f.get();
+        }
+
+        //a shared_future gives a const reference to its value, which is copied unless R
+        //is a reference itself, so nothing points in to the future after it is gone
+        template<typename ValT>
+        static typename std::enable_if<!std::is_void<ValT>::value>::type
+        PushValue(lua_State* L, Fut& f)
+        {
+            PushFuncResult<ValT,pol>(L,f.get());
+        }
+
+        Fut fut;
+    };
+
+
+    /**
+     * The async_task of a coroutine which is waiting in AwaitWait
+     */
+    class await_task : public async_task
+    {
+    public:
+        explicit await_task(std::shared_ptr<await_state> s) : state(std::move(s))
+        {
+            state->task = this;
+        }
+
+        ~await_task()
+        {
+            if(state->task == this)
+                state->task = nullptr;
+        }
+
+        bool ready() override
+        {
+            return !waiting || state->ready();
+        }
+
+        void release() override
+        {
+            async_task::release();
+            if(state->task == this)
+                state->task = nullptr;
+        }
+
+    private:
+        std::shared_ptr<await_state> state;
+    };
+
+
+    //inline rather than static, so that every translation unit has the same addresses
+    inline void* AwaitDoneKey()
+    {
+        static char key;
+        return &key;
+    }
+
+    inline void* AwaitFactoryKey()
+    {
+        static char key;
+        return &key;
+    }
+
+    static const char* const await_metatable = "cglb_await_mt";
+
+    /**
+     * Whether L can yield until a future is ready, or has to wait for it. The main thread
+     * can't, and neither can a coroutine without an executor. Before Lua 5.3, there is no
+     * telling whether a coroutine is in a call which can't yield (like a metamethod),
+     * which AwaitWait finds out by trying.
+     */
+    static async_executor* AwaitExecutor(lua_State* L)
+    {
+        state_context* ctx = state_context::get(L);
+        if(ctx == nullptr || ctx->executor == nullptr)
+            return nullptr;
+#if LUA_VERSION_NUM >= 503
+        if(!lua_isyieldable(L))
+            return nullptr;
+#else
+        bool main = lua_pushthread(L) != 0;                 //[1] = thread
+        lua_pop(L,1);                                       //pop[1]
+        if(main)
+            return nullptr;
+#endif
+        return ctx->executor;
+    }
+
+
+    static int AwaitStateGC(lua_State* L)
+    {
+        typedef std::shared_ptr<await_state> HandleT;
+        static_cast<HandleT*>(lua_touserdata(L,1))->~HandleT();
+        return 0;
+    }
+
+    /**
+     * Pushes a userdata which holds a new StateT for fut. The userdata and its metatable
+     * are made first, and the state is only made (taking fut) once nothing can raise a
+     * Lua error, so that neither of them is leaked by one.
+     */
+    template<typename StateT, typename Fut>
+    static void PushAwaitState(lua_State* L, Fut& fut)
+    {
+        typedef std::shared_ptr<await_state> HandleT;
+        void* block = lua_newuserdata(L,sizeof(HandleT));  //[1] = handle
+        if(luaL_newmetatable(L,await_metatable))            //[2] = metatable
+        {
+            lua_pushcfunction(L,&AwaitStateGC);
+            lua_setfield(L,-2,"__gc");
+        }
+        new (block) HandleT(std::make_shared<StateT>(std::move(fut)));
+        lua_setmetatable(L,-2);                             //pop[2]
+    }
+
+
+    /**
+     * The wait of the Lua side of a call which returned a future which was not ready (see
+     * WrapAwaitClosure). Argument 1 is the await_state userdata. Returns the done key and
+     * the results once they are there, and yields the userdata (so that a script which
+     * resumes the coroutine itself can tell this yield apart) until then. The Lua side
+     * calls it again whenever the coroutine is resumed, so being resumed early only yields
+     * again.
+     */
+    static int AwaitWait(lua_State* L)
+    {
+        typedef std::shared_ptr<await_state> HandleT;
+        HandleT& handle = *static_cast<HandleT*>(luaL_checkudata(L,1,await_metatable));
+        lua_settop(L,1);
+        async_executor* executor = AwaitExecutor(L);
+        if(handle->ready() || executor == nullptr)
+        {
+            //the executor does not resume a coroutine which is not waiting any more
+            if(handle->task != nullptr)
+                handle->task->waiting = false;
+            lua_pushlightuserdata(L,AwaitDoneKey());
+            return handle->push(L) + 1;
+        }
+
+        async_task* task = handle->task;
+        if(task == nullptr)
+        {
+            lua_pushthread(L);                              //[2] = thread
+            std::unique_ptr<async_task> owned(new await_task(handle));
+            task = owned.get();
+            task->thread = L;
+            task->thread_ref = luaL_ref(L,LUA_REGISTRYINDEX);   //pop[2]
+            task->owner = state_context::get(L);
+            executor->submit(std::move(owned));
+        }
+#if LUA_VERSION_NUM < 502
+        //lua_yield raises an error before changing anything if L can't yield, which
+        //leaves the task not waiting, so the executor only releases it
+        int status = lua_yield(L,1);
+        task->waiting = true;
+        return status;
+#else
+        //lua_yield does not return. 5.3 and later checked lua_isyieldable, and in Lua 5.2
+        //the Lua side calls this through pcall, and AwaitUnwait takes the mark back off
+        //if the yield fails
+        task->waiting = true;
+        return lua_yield(L,1);
+#endif
+    }
+
+
+#if LUA_VERSION_NUM == 502
+    /**
+     * Called by the Lua side in Lua 5.2 when AwaitWait raised an error, which is at index
+     * 2. If the task is still marked as waiting, the error is from lua_yield, because L
+     * can't yield: the mark is taken off before anything else runs, so the executor only
+     * releases the task, and the results are returned after the done key, waiting for
+     * the future like a call which can't yield does in Lua 5.3. Any other error is raised
+     * again.
+     */
+    static int AwaitUnwait(lua_State* L)
+    {
+        typedef std::shared_ptr<await_state> HandleT;
+        HandleT& handle = *static_cast<HandleT*>(luaL_checkudata(L,1,await_metatable));
+        if(handle->task == nullptr || !handle->task->waiting)
+        {
+            lua_settop(L,2);
+            return lua_error(L);
+        }
+        handle->task->waiting = false;
+        lua_settop(L,1);
+        lua_pushlightuserdata(L,AwaitDoneKey());
+        return handle->push(L) + 1;
+    }
+#endif
+
+
+    /**
+     * Returns the results of a call which gave the future fut. This is returned straight
+     * from the lua_CFunction, whose closure was wrapped by WrapAwaitClosure. If fut is
+     * ready, or L can't yield until it is, the results are returned after the done key,
+     * waiting for them if needed. Otherwise the Lua side is given the await_state to
+     * yield with, see AwaitWait.
+     */
+    template<typename pol, typename Fut>
+    static int AwaitResult(lua_State* L, Fut fut)
+    {
+        typedef future_state<Fut,pol> StateT;
+        if(StateT::IsReady(fut) || AwaitExecutor(L) == nullptr)
+        {
+            lua_pushlightuserdata(L,AwaitDoneKey());
+            return StateT::Push(L,fut) + 1;
+        }
+        PushAwaitState<StateT>(L,fut);
+        return 1;
+    }
+
+
+    /**
+     * Replaces the closure on top of the stack, which returns through AwaitResult, with a
+     * Lua function which calls it and waits with AwaitWait until it is done. The function
+     * is made by a chunk which is loaded once per lua_State. In Lua 5.2, the chunk calls
+     * AwaitWait through pcall (which can yield there), so that a yield which fails is
+     * handled by AwaitUnwait.
+     */
+    static void WrapAwaitClosure(lua_State* L)
+    {
+        static const char chunk[] =
+#if LUA_VERSION_NUM == 502
+            "local call, done, await, unwait = ...\n"
+            "local pcall = pcall\n"
+            "local function waited(state, ok, ...)\n"
+            "    if ok then return ... end\n"
+            "    return unwait(state, ...)\n"
+            "end\n"
+            "local function wait(state) return waited(state, pcall(await, state)) end\n"
+#else
+            "local call, done, wait = ...\n"
+#endif
+            "local function finish(state, first, ...)\n"
+            "    if first == done then return ... end\n"
+            "    return finish(state, wait(state))\n"
+            "end\n"
+            "local function start(first, ...)\n"
+            "    if first == done then return ... end\n"
+            "    return finish(first, wait(first))\n"
+            "end\n"
+            "return function(...) return start(call(...)) end\n";
+
+        int fnidx = lua_gettop(L);
+        lua_pushlightuserdata(L,AwaitFactoryKey());         //[2] = key
+        lua_rawget(L,LUA_REGISTRYINDEX);                    //[2] = factory
+        if(lua_isnil(L,-1))
+        {
+            lua_pop(L,1);                                   //pop[2]
+            if(luaL_loadbuffer(L,chunk,sizeof(chunk) - 1,"=cglb await") != 0)
+                lua_error(L);                               //[2] = factory
+            lua_pushlightuserdata(L,AwaitFactoryKey());     //[3] = key
+            lua_pushvalue(L,-2);                            //[4] = [2]
+            lua_rawset(L,LUA_REGISTRYINDEX);                //registry[3] = [4]         -> pop[4,3]
+        }
+        lua_pushvalue(L,fnidx);                             //[3] = call
+        lua_pushlightuserdata(L,AwaitDoneKey());            //[4] = done
+        lua_pushcfunction(L,&AwaitWait);                    //[5] = wait
+#if LUA_VERSION_NUM == 502
+        lua_pushcfunction(L,&AwaitUnwait);                  //[6] = unwait
+        lua_call(L,4,1);                                    //[2] = wrapper             -> pop[6,5,4,3]
+#else
+        lua_call(L,3,1);                                    //[2] = wrapper             -> pop[5,4,3]
+#endif
+        lua_replace(L,fnidx);                               //[1] = [2]                 -> pop[2]
+    }
+
+
+    /**
+     * WrapAwaitClosure if R is a future, for the closure of a function which returns R
+     */
+    template<typename R>
+    static typename std::enable_if<is_awaitable<typename std::decay<R>::type>::value>::type
+    WrapAwaitable(lua_State* L)
+    {
+        WrapAwaitClosure(L);
+    }
+
+    template<typename R>
+    static typename std::enable_if<!is_awaitable<typename std::decay<R>::type>::value>::type
+    WrapAwaitable(lua_State*)
+    {
+    }
+
+
+
+
+    /**
+     * What an argument of type FnArgT is held as while the other arguments are gathered,
+     * which is whatever FetchFuncArg returns for it. References to objects stay
+     * references in to the userdata, and values are moved in to the call.
+     */
+    template<typename FnArgT, typename pol>
+    struct arg_holder
+    {
+        typedef decltype(FetchFuncArg<FnArgT,pol>(nullptr,0)) type;
+    };
 
 
 
 
     //Non-value returning member function
-    template<typename T, typename FnPtrT, typename Traits, typename pol
-             , typename... Args, typename R = typename Traits::result_type>
+    template<typename T, typename FnPtrT, typename Traits, typename pol, typename Tuple
+            , typename R = typename Traits::result_type, size_t... I>
     static typename std::enable_if< std::is_same<R,void>::value,int >::type
-    /*static int*/ MemberFunctionCall(lua_State* L, T* self, FnPtrT fnptr, Args ... a)
+    /*static int*/ MemberFunctionCall(lua_State* L, T* self, FnPtrT fnptr, Tuple& args, index_list<I...>)
     {
         (void)L; //unused
-        (self->*fnptr)(a ...);
+        (void)args; //unused if there are no arguments
+        (self->*fnptr)(std::forward<typename std::tuple_element<I,Tuple>::type>(std::get<I>(args)) ...);
         return 0;
     }
 
     //Value-returning member function
-    template<typename T, typename FnPtrT, typename Traits, typename pol
-            , typename... Args, typename R = typename Traits::result_type>
-    static typename std::enable_if< !std::is_same<R,void>::value,int >::type
-    /*static int*/ MemberFunctionCall(lua_State* L, T* self, FnPtrT fnptr, Args ... a)
+    template<typename T, typename FnPtrT, typename Traits, typename pol, typename Tuple
+            , typename R = typename Traits::result_type, size_t... I>
+    static typename std::enable_if< !std::is_same<R,void>::value
+                                 && !is_awaitable<typename std::decay<R>::type>::value,int >::type
+    /*static int*/ MemberFunctionCall(lua_State* L, T* self, FnPtrT fnptr, Tuple& args, index_list<I...>)
     {
-        R ret = (self->*fnptr)(a ...);
+        (void)args; //unused if there are no arguments
         int top = lua_gettop(L);
-        PushFuncResult<R,pol>(L,ret);
+        //the result is moved straight in to PushFuncResult
+        PushFuncResult<R,pol>(L,(self->*fnptr)(std::forward<typename std::tuple_element<I,Tuple>::type>(std::get<I>(args)) ...));
         return lua_gettop(L) - top;
     }
 
+    //Member function returning a std::future, which may yield the coroutine
+    template<typename T, typename FnPtrT, typename Traits, typename pol, typename Tuple
+            , typename R = typename Traits::result_type, size_t... I>
+    static typename std::enable_if< is_awaitable<typename std::decay<R>::type>::value,int >::type
+    /*static int*/ MemberFunctionCall(lua_State* L, T* self, FnPtrT fnptr, Tuple& args, index_list<I...>)
+    {
+        (void)args; //unused if there are no arguments
+        return AwaitResult<pol>(L,(self->*fnptr)(std::forward<typename std::tuple_element<I,Tuple>::type>(std::get<I>(args)) ...));
+    }
+
 
 
     //non-value returning function
-    template<typename FnPtrT, typename Traits, typename pol, typename... Args
-            , typename R = typename Traits::result_type>
+    template<typename FnPtrT, typename Traits, typename pol, typename Tuple
+            , typename R = typename Traits::result_type, size_t... I>
     static typename std::enable_if< std::is_same<R,void>::value,int >::type
-    /*static int*/ FunctionCall(lua_State* L, FnPtrT fnptr, Args ... a)
+    /*static int*/ FunctionCall(lua_State* L, FnPtrT fnptr, Tuple& args, index_list<I...>)
     {
-        (*fnptr)(a ...);
+        (void)L; //unused
+        (void)args; //unused if there are no arguments
+        (*fnptr)(std::forward<typename std::tuple_element<I,Tuple>::type>(std::get<I>(args)) ...);
         return 0;
     }
 
     //value returning function
-    template<typename FnPtrT, typename Traits, typename pol, typename... Args
-            , typename R = typename Traits::result_type>
-    static typename std::enable_if< !std::is_same<R,void>::value,int >::type
-    /*static int*/ FunctionCall(lua_State* L, FnPtrT fnptr, Args ... a)
+    template<typename FnPtrT, typename Traits, typename pol, typename Tuple
+            , typename R = typename Traits::result_type, size_t... I>
+    static typename std::enable_if< !std::is_same<R,void>::value
+                                 && !is_awaitable<typename std::decay<R>::type>::value,int >::type
+    /*static int*/ FunctionCall(lua_State* L, FnPtrT fnptr, Tuple& args, index_list<I...>)
     {
-        R ret = (*fnptr)(a ...);
+        (void)args; //unused if there are no arguments
         int top = lua_gettop(L);
-        PushFuncResult<R,pol>(L,ret);
+        PushFuncResult<R,pol>(L,(*fnptr)(std::forward<typename std::tuple_element<I,Tuple>::type>(std::get<I>(args)) ...));
         return lua_gettop(L) - top;
     }
 
+    //function returning a std::future, which may yield the coroutine
+    template<typename FnPtrT, typename Traits, typename pol, typename Tuple
+            , typename R = typename Traits::result_type, size_t... I>
+    static typename std::enable_if< is_awaitable<typename std::decay<R>::type>::value,int >::type
+    /*static int*/ FunctionCall(lua_State* L, FnPtrT fnptr, Tuple& args, index_list<I...>)
+    {
+        (void)args; //unused if there are no arguments
+        return AwaitResult<pol>(L,(*fnptr)(std::forward<typename std::tuple_element<I,Tuple>::type>(std::get<I>(args)) ...));
+    }
 
 
 
 
 
+
+    /**
+     * Gathers the N-1 arguments of fptr from the stack in to one tuple, then calls fptr
+     * with them forwarded out of the tuple. For a member function pointer, the object
+     * is at index 1 and the arguments start at index 2.
+     */
     template<int N>
     struct GatherArgs
     {
-        template<typename FnPtrT, typename Traits, typename pol, typename... Args
-                , typename O = 
-                    typename std::conditional<
-                    std::is_member_function_pointer<FnPtrT>::value,
-                    std::integral_constant<int,0>::type,
-                    std::integral_constant<int,1>::type>
-                ::type>
-        static int Gather(lua_State* L, FnPtrT fptr, Args ... a)
+        template<typename FnPtrT, typename Traits, typename pol>
+        static int Gather(lua_State* L, FnPtrT fptr)
         {
-            typedef typename Traits::template arg<(size_t)(N-2)>::type FnArgT;
-            //If it is a member function pointer, then there is one more object on the stack
-            //than there are arguments for the function call to fptr.
-            FnArgT arg = GetFuncArg<FnArgT>(L,N - O::value);
-            return GatherArgs<N-1>::template Gather<FnPtrT,Traits,pol>(L,fptr,arg,a ...);
+            return GatherIndexed<FnPtrT,Traits,pol>(L,fptr,typename make_index_list<(size_t)(N-1)>::type());
         }
-    };
 
+    private:
+        template<typename FnPtrT, typename Traits, typename pol, size_t... I>
+        static int GatherIndexed(lua_State* L, FnPtrT fptr, index_list<I...> indices)
+        {
+            const int first = std::is_member_function_pointer<FnPtrT>::value ? 2 : 1;
+            (void)first; //unused if there are no arguments
+            typedef std::tuple<typename arg_holder<typename Traits::template arg<I>::type,pol>::type ...> Tuple;
+            //braces, so that the arguments are read in order
+            Tuple args{ FetchFuncArg<typename Traits::template arg<I>::type,pol>(L,first + (int)I) ... };
+            return Call<FnPtrT,Traits,pol>(L,fptr,args,indices);
+        }
 
-    template <>
-    struct GatherArgs<1>
-    {
-        template <typename FnPtrT, typename Traits, typename pol, typename... Args>
+        template <typename FnPtrT, typename Traits, typename pol, typename Tuple, typename Indices>
         static typename std::enable_if<std::is_member_function_pointer<FnPtrT>::value,int>::type
-        /*static int*/ Gather(lua_State* L, FnPtrT fptr, Args ... a)
+        /*static int*/ Call(lua_State* L, FnPtrT fptr, Tuple& args, Indices indices)
         {
             typedef typename std::decay<typename Traits::owner_type>::type T;
             //type instance is always the first argument
-            T** holdPtr = static_cast<T**>(lua_touserdata(L,1));
-            if(holdPtr == NULL)
+            T* self = class_luarep<T>::check(L,1);
+            if(self == NULL)
             {
                 lua_pushnil(L);
                 return 1;
             }
-            T* self = *holdPtr;
-            return MemberFunctionCall<T,FnPtrT,Traits,pol>(L,self,fptr,a...);    
+            return MemberFunctionCall<T,FnPtrT,Traits,pol>(L,self,fptr,args,indices);
         }
 
-        template <typename FnPtrT, typename Traits, typename pol, typename... Args>
+        template <typename FnPtrT, typename Traits, typename pol, typename Tuple, typename Indices>
         static typename std::enable_if<!std::is_member_function_pointer<FnPtrT>::value,int>::type
-        /*static int*/ Gather(lua_State* L, FnPtrT fptr, Args ... a)
+        /*static int*/ Call(lua_State* L, FnPtrT fptr, Tuple& args, Indices indices)
         {
-            return FunctionCall<FnPtrT,Traits,pol>(L,fptr,a...);
+            return FunctionCall<FnPtrT,Traits,pol>(L,fptr,args,indices);
+        }
+    };
+
+
+
+    static bool IsWholeNumber(lua_State* L, int idx)
+    {
+        if(lua_type(L,idx) != LUA_TNUMBER)
+            return false;
+        lua_Number n = lua_tonumber(L,idx);
+        return std::floor(n) == n;
+    }
+
+
+    /**
+     * How well the value at idx fits an integer argument. Lua 5.3 and later have
+     * luaL_checkinteger refuse a fraction (or a float past the range of lua_Integer),
+     * where earlier versions truncate it.
+     */
+    static int ScoreInteger(lua_State* L, int idx)
+    {
+#if LUA_VERSION_NUM >= 503
+        int isnum = 0;
+        lua_tointegerx(L,idx,&isnum);
+        if(isnum == 0)
+            return -1;
+        return lua_type(L,idx) == LUA_TNUMBER ? 2 : 1;
+#else
+        return IsWholeNumber(L,idx) ? 2 : (lua_isnumber(L,idx) ? 1 : -1);
+#endif
+    }
+
+
+    /**
+     * How well the value at idx fits an argument of type T, for choosing between the
+     * overloads of a function (see overload_def.h): 2 if it is the Lua type for T, 1 if
+     * GetFuncArg would convert it (a numeric string for a number, a number for a string
+     * or a bool, nil for a pointer, and before Lua 5.3 a fractional number for an
+     * integer), and -1 if it does not fit at all.
+     */
+    template<typename T
+        , typename DecayT = typename std::decay<typename std::remove_reference<T>::type>::type
+        , typename ClassT = typename std::decay<typename std::remove_pointer<DecayT>::type>::type>
+    static typename std::enable_if<
+        !std::is_class<ClassT>::value || is_string_class<DecayT>::value,
+    int >::type
+    ScoreFuncArg(lua_State* L, int idx)
+    {
+        int type = lua_type(L,idx);
+        if(std::is_same<DecayT,bool>::value)
+            return type == LUA_TBOOLEAN ? 2 : (type == LUA_TNUMBER ? 1 : -1);
+        if(std::is_integral<DecayT>::value || std::is_enum<DecayT>::value)
+            return ScoreInteger(L,idx);
+        if(std::is_arithmetic<DecayT>::value)
+            return type == LUA_TNUMBER ? 2 : (lua_isnumber(L,idx) ? 1 : -1);
+        if(std::is_same<const char*,DecayT>::value || is_string_class<DecayT>::value)
+            return type == LUA_TSTRING ? 2 : (type == LUA_TNUMBER ? 1 : -1);
+        //pointers to non-class types take anything, like lua_topointer
+        return 1;
+    }
+
+
+    /**
+     * 1 if T is an integer and the value at idx is a whole number, which an integer
+     * overload should get ahead of a floating point one, otherwise 0
+     */
+    template<typename T
+        , typename DecayT = typename std::decay<typename std::remove_reference<T>::type>::type>
+    static int ScoreIntegralTie(lua_State* L, int idx)
+    {
+        return std::is_integral<DecayT>::value && !std::is_same<DecayT,bool>::value
+            && IsWholeNumber(L,idx) ? 1 : 0;
+    }
+
+
+    template<typename T
+        , typename DecayT = typename std::decay<typename std::remove_reference<T>::type>::type
+        , typename ClassT = typename std::decay<typename std::remove_pointer<DecayT>::type>::type>
+    static typename std::enable_if<
+        std::is_class<ClassT>::value && !is_string_class<DecayT>::value,
+    int >::type
+    ScoreFuncArg(lua_State* L, int idx)
+    {
+        //containers which are taken by value or const reference can also be a table
+        const bool from_table = is_table_container<DecayT>::value
+            && (!std::is_reference<T>::value || std::is_const<typename std::remove_reference<T>::type>::value);
+        if(from_table && lua_istable(L,idx))
+            return 2;
+        if(class_luarep<ClassT>::check(L,idx) != NULL)
+            return 2;
+        //only a pointer can be NULL
+        return std::is_pointer<DecayT>::value && lua_isnil(L,idx) ? 1 : -1;
+    }
+
+
+    //the bit of a Lua type (LUA_TNONE too) in the masks of ArgTypeMask
+    static unsigned LuaTypeBit(int type)
+    {
+        return 1u << (type + 1);
+    }
+
+
+    /**
+     * The Lua types which ScoreFuncArg<T> may find to fit, as LuaTypeBit masks, so that
+     * an overload_def can pass over a function whose first argument does not fit
+     * without scoring it.
+     */
+    template<typename T
+        , typename DecayT = typename std::decay<typename std::remove_reference<T>::type>::type
+        , typename ClassT = typename std::decay<typename std::remove_pointer<DecayT>::type>::type>
+    static typename std::enable_if<
+        !std::is_class<ClassT>::value || is_string_class<DecayT>::value,
+    unsigned >::type
+    ArgTypeMask()
+    {
+        if(std::is_same<DecayT,bool>::value)
+            return LuaTypeBit(LUA_TBOOLEAN) | LuaTypeBit(LUA_TNUMBER);
+        if(std::is_arithmetic<DecayT>::value || std::is_enum<DecayT>::value
+        || std::is_same<const char*,DecayT>::value || is_string_class<DecayT>::value)
+            return LuaTypeBit(LUA_TNUMBER) | LuaTypeBit(LUA_TSTRING);
+        return ~0u;
+    }
+
+    template<typename T
+        , typename DecayT = typename std::decay<typename std::remove_reference<T>::type>::type
+        , typename ClassT = typename std::decay<typename std::remove_pointer<DecayT>::type>::type>
+    static typename std::enable_if<
+        std::is_class<ClassT>::value && !is_string_class<DecayT>::value,
+    unsigned >::type
+    ArgTypeMask()
+    {
+        const bool from_table = is_table_container<DecayT>::value
+            && (!std::is_reference<T>::value || std::is_const<typename std::remove_reference<T>::type>::value);
+        return LuaTypeBit(LUA_TUSERDATA)
+             | (from_table ? LuaTypeBit(LUA_TTABLE) : 0u)
+             | (std::is_pointer<DecayT>::value ? LuaTypeBit(LUA_TNIL) : 0u);
+    }
+
+
+    //more than the ScoreIntegralTie of any signature, see signature_score
+    static const int signature_tie_range = 64;
+
+
+    /**
+     * The sum of ScoreFuncArg for the arguments of FnPtrT, or -1 if one of them does
+     * not fit, or if there are not exactly as many arguments as FnPtrT takes. The sum
+     * is scaled by signature_tie_range, and ScoreIntegralTie is added to break ties, so
+     * f(int) is picked over f(double) for 1, but not f(int,int) over f(double,string)
+     * for (1,"a"). A match is at least 1, even without arguments, since 0 is the score
+     * of a function which reads its own arguments.
+     */
+    template<typename FnPtrT, typename Traits>
+    struct signature_score
+    {
+        static int Score(lua_State* L)
+        {
+            return ScoreIndexed(L,typename make_index_list<Traits::arity>::type());
+        }
+
+    private:
+        template<size_t... I>
+        static int ScoreIndexed(lua_State* L, index_list<I...>)
+        {
+            const int first = std::is_member_function_pointer<FnPtrT>::value ? 2 : 1;
+            if(lua_gettop(L) - first + 1 != (int)Traits::arity)
+                return -1;
+            //the leading 0 is so that there is no empty array for functions without arguments
+            const int scores[] = { 0, ScoreFuncArg<typename Traits::template arg<I>::type>(L,first + (int)I) ... };
+            const int ties[] = { 0, ScoreIntegralTie<typename Traits::template arg<I>::type>(L,first + (int)I) ... };
+            int total = 0;
+            int tie = 0;
+            for(size_t i = 0; i < sizeof(scores) / sizeof(scores[0]); ++i)
+            {
+                if(scores[i] < 0)
+                    return -1;
+                total += scores[i];
+                tie += ties[i];
+            }
+            return total * signature_tie_range + tie + 1;
         }
-        
     };
 
 
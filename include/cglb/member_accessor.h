@@ -0,0 +1,45 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "lua_include.h"
+#include <cstddef>
+
+namespace cglb {
+namespace detail {
+
+
+/**
+ * Calls the function stored in def (a function_def, custom_function_def or memdat_def)
+ * with the arguments on the stack, like the LuaFunction of the def would, but without
+ * needing a closure for it.
+ */
+typedef int (*accessor_fn)(lua_State* L, void* def);
+
+
+/**
+ * What the metatable of a type holds for the name of a member data, getter or setter.
+ * It is a full userdata without a metatable, so __index and __newindex can tell it
+ * apart from methods with a lua_type check, and it is freed with the metatable.
+ *
+ * get is called with the object at index 1 and the key at index 2, and is nullptr
+ * for write only members. set is called with the object at index 1 and the value at
+ * index 2 (like obj:set(value)), and is nullptr for read only members.
+ *
+ * Member data of a field_type (see field_def.h) use the same get and set for every
+ * field of the class, with the accessor itself as the def, and offset and field
+ * telling them where the data is and what type it is.
+ */
+struct member_accessor
+{
+    accessor_fn get;
+    void* get_def;
+    accessor_fn set;
+    void* set_def;
+    size_t offset;
+    unsigned char field;
+};
+
+}
+}
@@ -0,0 +1,105 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "member_accessor.h"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace cglb {
+namespace detail {
+
+
+/**
+ * One member of a sealed type. key is the address of the interned Lua string of the
+ * name. Getters have an accessor, and everything else (methods) is value, an index in
+ * to the table of values which is kept along with the member_hash.
+ */
+struct member_hash_entry
+{
+    const void* key;
+    member_accessor* accessor;
+    int value;
+};
+
+
+/**
+ * A perfect hash from the names of the members of a sealed type to the members. Made
+ * by class_luadef<T>::seal, and lives in a userdata which is an upvalue of __index.
+ *
+ * Lua interns strings, so the same name is always the same address, and a lookup is a
+ * multiply, a shift and a pointer compare. A key which is not in the hash (or a long
+ * string which Lua 5.2+ did not intern) is simply a miss, and __index falls back to
+ * the metatable.
+ */
+struct member_hash
+{
+    uint64_t multiplier;
+    unsigned shift;
+    size_t size;
+    member_hash_entry entries[1];   //size of them
+
+    const member_hash_entry* find(const void* key) const
+    {
+        const member_hash_entry* e = &entries[slot(key,multiplier,shift)];
+        return e->key == key ? e : nullptr;
+    }
+
+    static size_t slot(const void* key, uint64_t multiplier, unsigned shift)
+    {
+        return (size_t)(((uint64_t)(uintptr_t)key * multiplier) >> shift);
+    }
+
+    static size_t bytes_for(size_t size)
+    {
+        return sizeof(member_hash) + (size - 1) * sizeof(member_hash_entry);
+    }
+
+    /**
+     * Finds a multiplier which puts every key in its own slot, and returns the size of
+     * the table (a power of 2) that needs, or 0 if none was found.
+     */
+    static size_t build(std::vector<member_hash_entry> const& members, uint64_t& multiplier, unsigned& shift)
+    {
+        size_t size = 2;
+        unsigned bits = 1;
+        while(size < members.size() * 2)
+        {
+            size *= 2;
+            ++bits;
+        }
+
+        uint64_t seed = 0x9E3779B97F4A7C15ull;
+        std::vector<bool> used;
+        for(int grow = 0; grow < 4; ++grow, size *= 2, ++bits)
+        {
+            shift = 64 - bits;
+            for(int attempt = 0; attempt < 256; ++attempt)
+            {
+                //odd multipliers from a simple LCG
+                seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+                multiplier = seed | 1;
+                used.assign(size,false);
+                bool perfect = true;
+                for(member_hash_entry const& m : members)
+                {
+                    size_t s = slot(m.key,multiplier,shift);
+                    if(used[s])
+                    {
+                        perfect = false;
+                        break;
+                    }
+                    used[s] = true;
+                }
+                if(perfect)
+                    return size;
+            }
+        }
+        return 0;
+    }
+};
+
+}
+}
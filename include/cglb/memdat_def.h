@@ -36,19 +36,17 @@ struct memdat_def
     }
     MemPtrT memptr;
 
-    
-    static int LuaGetFunction(lua_State* L)
+    /**
+     * Called directly by __index through a member_accessor, so that there is no
+     * closure call. Index 1 is the pointer to the instance of T, and index 2 is
+     * the key (which isn't used).
+     */
+    static int Get(lua_State* L, void* def)
     {
-        /*
-         * __cglb_getters is set up in a way so that index 1
-         * is the pointer to the instance of T, and index 2 is
-         * the key (which isn't used).
-         * upvalue at index 1 is an instance of this class
-         */
         typedef typename traits::owner_type OwnerT;
         typedef policy<return_gc<std::false_type>> pol; //get should never return a gc type
         typedef memdat_def<MemPtrT,traits> ThisT;
-        ThisT* self = (ThisT*)lua_touserdata(L,lua_upvalueindex(1));
+        ThisT* self = (ThisT*)def;
         OwnerT* obj = class_luarep<OwnerT>::check(L,1);
         if(!obj)
         {
@@ -56,33 +54,26 @@ struct memdat_def
             return 1;
         }
         typename traits::data_type ret = obj->*(self->memptr);
-        //FIXME: Cannot have a gc'd get function
         detail::PushFuncResult<typename traits::data_type,pol>(L,ret);
         return 1;
     }
 
     
-    static int LuaSetFunction(lua_State* L)
+    /**
+     * Called directly by __newindex through a member_accessor. Index 1 is the
+     * pointer to the instance of T, and index 2 is the value.
+     */
+    static int Set(lua_State* L, void* def)
     {
-        /*
-            __cglb_setters is set up in a way so that 
-            index 1 is the instance of T
-            index 2 is the key (not used here)
-            index 3 is the value
-            upvalue index 1 is an instance of this class
-        */
         typedef typename traits::owner_type OwnerT;
         typedef memdat_def<MemPtrT,traits> ThisT;
-        ThisT* self = (ThisT*)lua_touserdata(L,lua_upvalueindex(1));
+        ThisT* self = (ThisT*)def;
 
         OwnerT* obj = class_luarep<OwnerT>::check(L,1);
         if(!obj)
-        {
-            lua_pushnil(L);
             return 0;
-        }
 
-        typename traits::data_type val = detail::GetFuncArg<typename traits::data_type>(L,3);
+        typename traits::data_type val = detail::GetFuncArg<typename traits::data_type>(L,2);
         obj->*(self->memptr) = val;
         return 0;
     }
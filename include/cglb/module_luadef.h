@@ -0,0 +1,486 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "function_traits.h"
+#include "function_def.h"
+#include "overload_def.h"
+#include "integer_interop.h"
+#include "string_ref.h"
+#include "lua_include.h"
+#include "policy/policy.h"
+#include "cglb_init.h"
+#include "class_luadef.h"
+#include <vector>
+#include <string>
+#include <type_traits>
+#include <initializer_list>
+#include <utility>
+#include <mutex>
+#include <unordered_map>
+#include <cstdlib>
+#include <typeinfo>
+
+namespace cglb {
+namespace detail {
+
+
+/**
+ * One member of a module, kept by module_luadef until the module table is made. Functions
+ * are only a lua_CFunction and the def for its upvalue, so hundreds of them cost nothing
+ * on the Lua side until commit. Values which can only be made in Lua (callables, enum
+ * tables, integers which need push_integer) are kept in the registry with luaL_ref.
+ */
+struct module_entry
+{
+    enum kind_t
+    {
+        kind_closure,       //function with def as its upvalue
+        kind_cfunction,     //plain lua_CFunction
+        kind_integer,
+        kind_number,
+        kind_boolean,
+        kind_string,
+        kind_ref            //in the registry
+    };
+
+    module_entry(const char* entry_name, kind_t k) :
+        name(entry_name), kind(k), function(nullptr), def(nullptr),
+        integer(0), number(0), ref(LUA_NOREF), await(false)
+    {
+    }
+
+    /**
+     * Pushes the value of the entry. A registry reference is released and set to
+     * LUA_NOREF, so that it is released once even if the entry is pushed again.
+     */
+    void push(lua_State* L)
+    {
+        switch(kind)
+        {
+        case kind_closure:
+            lua_pushlightuserdata(L,def);
+            lua_pushcclosure(L,function,1);
+            if(await)
+                WrapAwaitClosure(L);
+            break;
+        case kind_cfunction:    lua_pushcfunction(L,function);                      break;
+        case kind_integer:      lua_pushinteger(L,integer);                         break;
+        case kind_number:       lua_pushnumber(L,number);                           break;
+        case kind_boolean:      lua_pushboolean(L,integer != 0 ? 1 : 0);            break;
+        case kind_string:       lua_pushlstring(L,str.data(),str.size());           break;
+        case kind_ref:
+            lua_rawgeti(L,LUA_REGISTRYINDEX,ref);
+            luaL_unref(L,LUA_REGISTRYINDEX,ref);
+            ref = LUA_NOREF;
+            break;
+        }
+    }
+
+    std::string name;
+    kind_t kind;
+    lua_CFunction function;
+    void* def;
+    lua_Integer integer;    //also the value of kind_boolean
+    lua_Number number;
+    std::string str;
+    int ref;
+    bool await;             //kind_closure of a function which returns a future
+};
+
+}
+
+
+/**
+ * Binds free functions, constants and enums in to a module table, which is a global of the
+ * given name:
+ *
+ *     module_luadef(L,"geometry")
+ *         .add("Distance",&Distance)
+ *         .constant("PI",3.14159)
+ *         .add_enum<Shape>("Shape",{{"Circle",Shape::Circle},{"Square",Shape::Square}})
+ *         .commit();
+ *
+ * Nothing is done in Lua until commit(), so the table is made with one lua_createtable
+ * sized for every member, and filled in one pass with lua_rawset, with no rehashing. If
+ * the global is already a table (a module added to in two places), the members are added
+ * to it instead. commit() can raise a Lua error, so the destructor does not call it: a
+ * module_luadef which is destroyed without commit() adds nothing.
+ *
+ * With a nullptr module name, commit() leaves the table on the stack instead, for a
+ * luaopen_ function:
+ *
+ *     module_luadef m(L,nullptr);
+ *     m.add("Distance",&Distance);
+ *     m.commit();
+ *     return 1;
+ */
+struct module_luadef
+{
+    /**
+     * Constructor
+     */
+    module_luadef(lua_State* Ls, const char* module_name) :
+        L(Ls),name(module_name),pending(true)
+    {
+        std::lock_guard<std::mutex> lock(instantiate_mutex());
+        static bool recorded = false;
+        if(record_types && !recorded)
+        {
+            dealloc_functions.push_back(&module_luadef::DeallocateLuaDefs);
+            recorded = true;
+        }
+    }
+
+    module_luadef(module_luadef&& other) :
+        L(other.L),name(other.name),pending(other.pending),entries(std::move(other.entries))
+    {
+        other.pending = false;
+    }
+
+    module_luadef(const module_luadef&) = delete;
+    module_luadef& operator=(const module_luadef&) = delete;
+
+    /**
+     * Releases the registry references of the members which were not committed (which
+     * is all of them, or the rest of them if commit raised an error). Nothing is added
+     * to the module.
+     */
+    ~module_luadef()
+    {
+        for(auto const& entry : entries)
+        {
+            if(entry.kind == detail::module_entry::kind_ref && entry.ref != LUA_NOREF)
+                luaL_unref(L,LUA_REGISTRYINDEX,entry.ref);
+        }
+    }
+
+
+    /**
+     * Frees the function_defs of every module, which are shared by every lua_State like the
+     * ones of class_luadef<T>. Called by Quit if Init was called.
+     */
+    static void DeallocateLuaDefs()
+    {
+        std::lock_guard<std::mutex> lock(instantiate_mutex());
+        for(auto fnpair : registered_functions())
+        {
+            free(fnpair.second);
+        }
+        registered_functions().clear();
+    }
+
+
+    /**
+     * Makes room for n members, when adding a lot of them
+     */
+    module_luadef& reserve(size_t n)
+    {
+        entries.reserve(n);
+        return *this;
+    }
+
+
+    /**
+     * Add a free function. The arguments and the result are converted the same way as for
+     * class_luadef<T>::add, starting at index 1. A plain lua_CFunction is added as it is.
+     */
+    template< typename Func >
+    typename std::enable_if< std::is_pointer<Func>::value
+                          && std::is_function<typename std::remove_pointer<Func>::type>::value,
+    module_luadef& >::type
+    add(const char* fname, Func f)
+    {
+        return add<policy_return_nogc>(fname,f);
+    }
+
+
+    /**
+     * Same as add(fname, f), with the policy Pol for the calls of f
+     */
+    template< typename Pol, typename Func, typename Traits = function_traits<Func> >
+    typename std::enable_if< std::is_pointer<Func>::value
+                          && std::is_function<typename std::remove_pointer<Func>::type>::value
+                          && is_policy<Pol>::value,
+    module_luadef& >::type
+    add(const char* fname, Func f)
+    {
+        static_assert(!detail::takes_lua_state<Func,Traits>::value || std::is_same<Func,lua_CFunction>::value,
+            "Functions of a module which take a lua_State* must be lua_CFunctions");
+        GenDoc<Func>(ModuleName(), "function", fname);
+        AddFunction<Pol>(fname,f);
+        return *this;
+    }
+
+
+    /**
+     * Add a lambda or std::function, which is stored in its closure like with
+     * class_luadef<T>::add (see callable_def in function_def.h)
+     */
+    template< typename Func >
+    typename std::enable_if< std::is_class<Func>::value,
+    module_luadef& >::type
+    add(const char* fname, Func f)
+    {
+        return add<policy_return_nogc>(fname,std::move(f));
+    }
+
+
+    template< typename Pol, typename Func >
+    typename std::enable_if< std::is_class<Func>::value && is_policy<Pol>::value,
+    module_luadef& >::type
+    add(const char* fname, Func f)
+    {
+        GenDoc<Func>(ModuleName(), "function", fname);
+        callable_def<function_traits<Func>,Func,Pol>::Push(L,std::move(f));
+        AddRef(fname);
+        return *this;
+    }
+
+
+    /**
+     * Add a constant. Numbers, enums, booleans and strings are supported, and are pushed
+     * the same way as function results.
+     */
+    template< typename V >
+    typename std::enable_if< std::is_same<V,bool>::value,
+    module_luadef& >::type
+    constant(const char* cname, V v)
+    {
+        detail::module_entry entry(cname,detail::module_entry::kind_boolean);
+        entry.integer = v ? 1 : 0;
+        entries.push_back(std::move(entry));
+        return *this;
+    }
+
+    template< typename V >
+    typename std::enable_if< std::is_floating_point<V>::value,
+    module_luadef& >::type
+    constant(const char* cname, V v)
+    {
+        detail::module_entry entry(cname,detail::module_entry::kind_number);
+        entry.number = static_cast<lua_Number>(v);
+        entries.push_back(std::move(entry));
+        return *this;
+    }
+
+    template< typename V >
+    typename std::enable_if< (std::is_integral<V>::value && !std::is_same<V,bool>::value)
+                           || std::is_enum<V>::value,
+    module_luadef& >::type
+    constant(const char* cname, V v)
+    {
+        AddInteger(cname,static_cast<typename integer_of<V>::type>(v));
+        return *this;
+    }
+
+    module_luadef& constant(const char* cname, const char* v)
+    {
+        detail::module_entry entry(cname,detail::module_entry::kind_string);
+        entry.str = v;
+        entries.push_back(std::move(entry));
+        return *this;
+    }
+
+    template< typename V >
+    typename std::enable_if< detail::is_string_class<V>::value,
+    module_luadef& >::type
+    constant(const char* cname, const V& v)
+    {
+        detail::module_entry entry(cname,detail::module_entry::kind_string);
+        entry.str.assign(v.data(),v.size());
+        entries.push_back(std::move(entry));
+        return *this;
+    }
+
+
+    /**
+     * Add a table of the values of an enum, made with one lua_createtable sized for them:
+     *
+     *     .add_enum<Shape>("Shape",{{"Circle",Shape::Circle},{"Square",Shape::Square}})
+     *
+     * Values of enums are also accepted by constant, for enums which should not have a
+     * table of their own.
+     */
+    template< typename E >
+    typename std::enable_if< std::is_enum<E>::value,
+    module_luadef& >::type
+    add_enum(const char* ename, std::initializer_list<std::pair<const char*,E>> values)
+    {
+        typedef typename std::underlying_type<E>::type IntT;
+        lua_createtable(L,0,(int)values.size());            //[1] = enum table
+        for(auto const& value : values)
+        {
+            lua_pushstring(L,value.first);                  //[2] = name
+            detail::push_integer(L,static_cast<IntT>(value.second));   //[3] = value
+            lua_rawset(L,-3);                               //[1][name] = value         -> pop[3,2]
+        }
+        AddRef(ename);                                      //pop[1]
+        return *this;
+    }
+
+
+    /**
+     * Makes the module table with every member added so far, and sets it as the global (or
+     * leaves it on the stack, for a nullptr module name). Raises a Lua error if it runs out
+     * of memory, like any other Lua call.
+     */
+    void commit()
+    {
+        if(!pending)
+            return;
+        pending = false;
+
+        int top = lua_gettop(L);
+        if(name != nullptr)
+        {
+            lua_getglobal(L,name);                          //[1] = _G[name]
+            if(!lua_istable(L,-1))
+            {
+                lua_pop(L,1);                               //pop[1]
+                lua_createtable(L,0,(int)entries.size());   //[1] = module
+                lua_pushvalue(L,-1);                        //[2] = [1]
+                lua_setglobal(L,name);                      //_G[name] = [2]            -> pop[2]
+            }
+        }
+        else
+        {
+            lua_createtable(L,0,(int)entries.size());       //[1] = module
+        }
+
+        int modidx = lua_gettop(L);
+        for(auto& entry : entries)
+        {
+            lua_pushlstring(L,entry.name.data(),entry.name.size());    //[2] = name
+            entry.push(L);                                  //[3] = value
+            lua_rawset(L,modidx);                           //[1][name] = [3]           -> pop[3,2]
+        }
+        entries.clear();
+
+        if(name != nullptr)
+            lua_settop(L,top);                              //pop[1]
+    }
+
+
+private:
+    //the type an integer constant is pushed as
+    template< typename V, bool IsEnum = std::is_enum<V>::value >
+    struct integer_of
+    {
+        typedef V type;
+    };
+
+    template< typename V >
+    struct integer_of<V,true>
+    {
+        typedef typename std::underlying_type<V>::type type;
+    };
+
+
+    template< typename IntT >
+    typename std::enable_if< detail::uses_lua_integer<IntT>::value >::type
+    AddInteger(const char* cname, IntT v)
+    {
+        detail::module_entry entry(cname,detail::module_entry::kind_integer);
+        entry.integer = static_cast<lua_Integer>(v);
+        entries.push_back(std::move(entry));
+    }
+
+    //integers which lua_Integer does not hold, which push_integer may make a string of (or raise for)
+    template< typename IntT >
+    typename std::enable_if< !detail::uses_lua_integer<IntT>::value >::type
+    AddInteger(const char* cname, IntT v)
+    {
+        detail::push_integer(L,v);
+        AddRef(cname);
+    }
+
+
+    /**
+     * Pops the value on top of the stack in to the registry, as the entry for ename
+     */
+    void AddRef(const char* ename)
+    {
+        detail::module_entry entry(ename,detail::module_entry::kind_ref);
+        entry.ref = luaL_ref(L,LUA_REGISTRYINDEX);
+        entries.push_back(std::move(entry));
+    }
+
+
+    template< typename pol, typename Func >
+    typename std::enable_if< std::is_same<Func,lua_CFunction>::value >::type
+    AddFunction(const char* fname, Func f)
+    {
+        detail::module_entry entry(fname,detail::module_entry::kind_cfunction);
+        entry.function = f;
+        entries.push_back(std::move(entry));
+    }
+
+    /**
+     * The function_def of f is kept in registered_functions, and shared by every lua_State
+     * (and every name) which f is added with. The key is the type of the def and the bytes
+     * of f, so two modules never share a def unless it is for the same function.
+     */
+    template< typename pol, typename Func, typename Traits = function_traits<Func> >
+    typename std::enable_if< !std::is_same<Func,lua_CFunction>::value >::type
+    AddFunction(const char* fname, Func f)
+    {
+        typedef function_def<Traits,Func,pol> FnDefT;
+        std::string key = typeid(FnDefT).name();
+        key.append(reinterpret_cast<const char*>(&f),sizeof(f));
+
+        FnDefT* fndef = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(instantiate_mutex());
+            auto itr = registered_functions().find(key);
+            if(itr != registered_functions().end())
+            {
+                fndef = (FnDefT*)(itr->second);
+            }
+            else
+            {
+                fndef = (FnDefT*)malloc(sizeof(FnDefT));
+                fndef->fnptr = f;
+                registered_functions().insert(std::pair<std::string,void*>(key,(void*)fndef));
+            }
+        }
+
+        detail::module_entry entry(fname,detail::module_entry::kind_closure);
+        entry.function = &FnDefT::LuaFunction;
+        entry.def = fndef;
+        entry.await = detail::is_awaitable<typename std::decay<typename Traits::result_type>::type>::value;
+        entries.push_back(std::move(entry));
+    }
+
+
+    const char* ModuleName() const
+    {
+        return name != nullptr ? name : "";
+    }
+
+
+    /**
+     * The same as class_luadef<T>::registered_functions, for every module. A function
+     * local static, so that this header has no definitions outside of the class.
+     */
+    static std::unordered_map<std::string,void*>& registered_functions()
+    {
+        static std::unordered_map<std::string,void*> functions;
+        return functions;
+    }
+
+    static std::mutex& instantiate_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+
+    lua_State* L;
+    const char* name;   //Name of the global, or nullptr to leave the table on the stack
+    bool pending;       //false once commit() is done
+    std::vector<detail::module_entry> entries;
+};
+
+}
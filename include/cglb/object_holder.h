@@ -0,0 +1,261 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include <type_traits>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace cglb {
+namespace detail {
+
+
+struct type_record;
+
+
+/**
+ * True if Parent is a base of T which a pointer can be cast to by a fixed offset, which
+ * is not so for a virtual (or ambiguous) base, since static_cast cannot go back down
+ */
+template<typename Parent, typename T, typename = void>
+struct is_offset_base : public std::false_type
+{
+};
+
+template<typename Parent, typename T>
+struct is_offset_base<Parent, T, decltype(void(static_cast<T*>(std::declval<Parent*>())))>
+    : public std::is_base_of<Parent,T>
+{
+};
+
+/**
+ * One entry of the cast table of a type: a base class, and what to add to a pointer
+ * to the type to get a pointer to the base. Entries are never removed, and are not
+ * changed after they are published, so the table can be read without a lock.
+ */
+struct type_cast
+{
+    const type_record* base;
+    std::ptrdiff_t offset;
+    type_cast* next;
+};
+
+
+/**
+ * The type tag of a type. There is one record per type for the whole process, and
+ * its address is the tag stored in each userdata, so checking the type of a userdata
+ * is a pointer compare.
+ *
+ * The cast table is filled by class_luadef<T>::inherit, and is flattened so that
+ * every (indirect) base is a single entry. Virtual bases are rejected by add_base,
+ * since the offset to them is only known from an object.
+ */
+struct type_record
+{
+    type_record() : casts(nullptr), first_name(nullptr)
+    {
+    }
+
+    template<typename T>
+    static const type_record* of()
+    {
+        static type_record record;
+        return &record;
+    }
+
+    /**
+     * What to add to a pointer of this type to get a pointer to base. Returns false
+     * if base is not this type, or one of its bases.
+     */
+    bool cast_offset(const type_record* base, std::ptrdiff_t& offset) const
+    {
+        if(base == this)
+        {
+            offset = 0;
+            return true;
+        }
+        for(const type_cast* c = casts.load(std::memory_order_acquire); c != nullptr; c = c->next)
+        {
+            if(c->base == base)
+            {
+                offset = c->offset;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Records that Parent is a base of T, along with all of the bases of Parent
+     */
+    template<typename T, typename Parent>
+    static void add_base()
+    {
+        static_assert(std::is_base_of<Parent,T>::value, "inherit<Parent> requires Parent to be a base of T");
+        static_assert(is_offset_base<Parent,T>::value, "inherit<Parent> does not support a virtual or ambiguous base");
+        //the conversion is only done on the address, nothing is constructed here, which
+        //is why the base cannot be virtual (that would read the vptr of the probe)
+        typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type probe;
+        T* derived = reinterpret_cast<T*>(&probe);
+        std::ptrdiff_t offset = reinterpret_cast<char*>(static_cast<Parent*>(derived))
+                              - reinterpret_cast<char*>(derived);
+
+        type_record* self = const_cast<type_record*>(of<T>());
+        const type_record* parent = of<Parent>();
+        std::lock_guard<std::mutex> lock(cast_mutex());
+        self->add_cast(parent,offset);
+        for(const type_cast* c = parent->casts.load(std::memory_order_acquire); c != nullptr; c = c->next)
+        {
+            self->add_cast(c->base,offset + c->offset);
+        }
+    }
+
+    /**
+     * The name the type was first defined with by class_luadef, in any lua_State, or
+     * nullptr. For errors about a lua_State in which the type is not defined.
+     */
+    const char* name() const
+    {
+        return first_name.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Sets name, if it has not been set yet. Like the cast entries, the copy is never
+     * freed.
+     */
+    void set_name(const char* n)
+    {
+        if(name() != nullptr)
+            return;
+        std::lock_guard<std::mutex> lock(cast_mutex());
+        if(name() != nullptr)
+            return;
+        size_t len = std::strlen(n);
+        char* copy = new char[len + 1];
+        std::memcpy(copy,n,len + 1);
+        first_name.store(copy,std::memory_order_release);
+    }
+
+private:
+    std::atomic<type_cast*> casts;
+    std::atomic<const char*> first_name;
+
+    //cast_mutex must be held
+    void add_cast(const type_record* base, std::ptrdiff_t offset)
+    {
+        std::ptrdiff_t existing;
+        if(cast_offset(base,existing))
+            return;
+        type_cast* c = new type_cast();
+        c->base = base;
+        c->offset = offset;
+        c->next = casts.load(std::memory_order_relaxed);
+        casts.store(c,std::memory_order_release);
+    }
+
+    static std::mutex& cast_mutex()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    type_record(type_record const&);
+    type_record& operator=(type_record const&);
+};
+
+
+/**
+ * Where the object referenced by an object_holder lives
+ */
+enum holder_storage
+{
+    storage_pointer = 0, //the userdata holds a pointer to an object allocated elsewhere
+    storage_inline  = 1, //the object was constructed inside of the userdata block itself
+    storage_pooled  = 2, //the object was constructed in a block of the storage_pool of its type
+    storage_handle  = 3  //the userdata is a handle_holder, and the object is found through its slot_map
+};
+
+
+/**
+ * Who is responsible for destroying the object referenced by an object_holder
+ */
+enum holder_ownership
+{
+    ownership_owned    = 0, //Lua owns it, and __gc destroys it
+    ownership_borrowed = 1, //C++ owns it, so __gc leaves it alone
+    ownership_released = 2  //it was already destroyed, or ownership was given back to C++
+};
+
+
+/**
+ * Marks a userdata block as one made by class_luarep, so that check can tell it
+ * apart from userdata made by other libraries without looking at the metatable.
+ *
+ * The mark is the address of the type_record of the block scrambled with a constant,
+ * so a foreign block only passes if it holds both a pointer and the matching scrambled
+ * copy of it at the right offsets, rather than a few fixed bytes.
+ */
+inline std::uintptr_t holder_magic(const type_record* type)
+{
+    return reinterpret_cast<std::uintptr_t>(type) ^ static_cast<std::uintptr_t>(0x9E3779B97F4A7C15ULL);
+}
+
+
+/**
+ * The start of every userdata block pushed by class_luarep<T>.
+ *
+ * For pointer storage, obj is the pointer that was given to class_luarep<T>::push.
+ * For inline storage, obj points to the object directly after the holder in the
+ * same block, so getting the object back out is the same single load for both layouts.
+ *
+ * type is the type_record of the T it was pushed as, which class_luarep<U>::check
+ * compares against the record of U.
+ *
+ * Ownership is recorded per userdata, so neither push nor __gc need any bookkeeping
+ * outside of the block.
+ */
+struct object_holder
+{
+    void* obj;
+    const type_record* type;
+    std::uintptr_t magic;       //holder_magic(type)
+    unsigned char storage;
+    unsigned char owner;
+};
+
+
+/**
+ * Layout of a userdata block with an inline (by value) object
+ */
+template<typename T>
+struct inline_holder
+{
+    object_holder header;
+    typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type data;
+};
+
+
+/**
+ * Lua only guarantees that userdata blocks are aligned for this union (LUAI_USER_ALIGNMENT_T),
+ * so over-aligned types cannot be stored inline and fall back to pointer storage.
+ */
+union lua_user_alignment
+{
+    double u;
+    void* s;
+    long l;
+};
+
+template<typename T>
+struct can_store_inline : public std::integral_constant<bool,
+    std::alignment_of< inline_holder<T> >::value <= std::alignment_of<lua_user_alignment>::value>
+{
+};
+
+}
+}
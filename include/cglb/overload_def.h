@@ -0,0 +1,238 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "function_traits.h"
+#include "luafn_interop.h"
+#include "member_accessor.h"
+#include "lua_include.h"
+#include <type_traits>
+#include <algorithm>
+#include <limits>
+#include <cstddef>
+
+namespace cglb {
+namespace detail {
+
+
+/**
+ * Functions which take the lua_State* themselves (see custom_function_def), which
+ * read their own arguments. function_traits::arg<0> does not compile for functions
+ * without arguments, hence HasArgs.
+ */
+template<typename FnPtrT, typename Traits, bool HasArgs = (Traits::arity > 0)>
+struct takes_lua_state : public std::false_type
+{
+};
+
+template<typename FnPtrT, typename Traits>
+struct takes_lua_state<FnPtrT,Traits,true> : public std::integral_constant<bool,
+    !std::is_member_function_pointer<FnPtrT>::value
+ && std::is_same<typename Traits::template arg<0>::type,lua_State*>::value>
+{
+};
+
+
+typedef int (*overload_score_fn)(lua_State* L);
+
+//functions which read their own arguments fit anything, but with the lowest score there
+//is, so that every function which fits goes first (see signature_score)
+inline int any_arguments_score(lua_State*)
+{
+    return 0;
+}
+
+template<typename FnPtrT, typename Traits>
+typename std::enable_if<takes_lua_state<FnPtrT,Traits>::value,overload_score_fn>::type
+overload_score()
+{
+    return &any_arguments_score;
+}
+
+template<typename FnPtrT, typename Traits>
+typename std::enable_if<!takes_lua_state<FnPtrT,Traits>::value,overload_score_fn>::type
+overload_score()
+{
+    return &signature_score<FnPtrT,Traits>::Score;
+}
+
+
+/**
+ * How many Lua arguments a function of an overload_def takes, counting the object for
+ * a member function, or -1 for a function which reads its own arguments
+ */
+template<typename FnPtrT, typename Traits = function_traits<FnPtrT>>
+struct overload_nargs : public std::integral_constant<int,
+    takes_lua_state<FnPtrT,Traits>::value ? -1
+  : (int)Traits::arity + (std::is_member_function_pointer<FnPtrT>::value ? 1 : 0)>
+{
+};
+
+template<typename... Funcs>
+struct max_overload_nargs : public std::integral_constant<int,-1>
+{
+};
+
+template<typename Func, typename... Funcs>
+struct max_overload_nargs<Func,Funcs...> : public std::integral_constant<int,
+    (overload_nargs<Func>::value > max_overload_nargs<Funcs...>::value)
+        ? overload_nargs<Func>::value : max_overload_nargs<Funcs...>::value>
+{
+};
+
+
+/**
+ * The Lua types the first argument (after the object) of a function may be, see
+ * ArgTypeMask. Anything for functions without one, or which read their own.
+ */
+template<typename FnPtrT, typename Traits
+    , bool HasArg = (Traits::arity > 0) && !takes_lua_state<FnPtrT,Traits>::value>
+struct overload_first_arg
+{
+    static unsigned types()
+    {
+        return ~0u;
+    }
+};
+
+template<typename FnPtrT, typename Traits>
+struct overload_first_arg<FnPtrT,Traits,true>
+{
+    static unsigned types()
+    {
+        return ArgTypeMask<typename Traits::template arg<0>::type>();
+    }
+};
+
+
+/**
+ * One of the functions of an overload_def, with the def made for it by
+ * class_luadef<T>::MakeFunctionDef
+ */
+struct overload_entry
+{
+    overload_score_fn score;
+    accessor_fn invoke;
+    void* def;
+    int nargs;              //see overload_nargs
+    int first_arg;          //the stack index of the first argument after the object
+    unsigned first_types;   //see overload_first_arg
+};
+
+}
+
+
+/**
+ * Several functions under one name, made by class_luadef<T>::add(name, f1, f2, ...).
+ *
+ * The functions are bucketed by how many Lua arguments they take when the def is made,
+ * so a call only looks at the functions which take as many arguments as it was given,
+ * and of those, passes over the ones whose first argument cannot be the Lua type of
+ * the first argument given. The rest are scored against the arguments on the stack
+ * (see detail::signature_score), and the one which fits best is called, or the first
+ * of them if there is a tie. A whole number fits an integer better than a floating
+ * point number. Functions which read their own arguments are only called when no
+ * other function fits.
+ */
+struct overload_def
+{
+    const char* name;     //the key in registered_functions, which outlives this
+    size_t count;
+    int max_nargs;        //the most arguments a function takes, -1 if all read their own
+    size_t* buckets;      //max_nargs + 2 of them, after the entries, see finish
+    detail::overload_entry entries[1];   //count of them
+
+    static size_t bytes_for(size_t count, int max_nargs)
+    {
+        return sizeof(overload_def) + (count - 1) * sizeof(detail::overload_entry)
+             + (max_nargs + 2) * sizeof(size_t);
+    }
+
+    /**
+     * Called once the entries are filled in. Sorts them by how many arguments they take,
+     * keeping the order they were given in otherwise, so that the functions which take
+     * n arguments are entries[buckets[n]] up to entries[buckets[n + 1]]. The functions
+     * which read their own arguments are last, from entries[buckets[max_nargs + 1]].
+     */
+    void finish(int max)
+    {
+        max_nargs = max;
+        buckets = reinterpret_cast<size_t*>(entries + count);
+        std::stable_sort(entries,entries + count,
+            [](const detail::overload_entry& a, const detail::overload_entry& b)
+            {
+                return sort_key(a) < sort_key(b);
+            });
+        size_t i = 0;
+        for(int n = 0; n <= max_nargs + 1; ++n)
+        {
+            buckets[n] = i;
+            while(i < count && entries[i].nargs == n)
+                ++i;
+        }
+    }
+
+    /**
+      * Used as the C callback associated to the name.
+      * The upvalue at index 1 is an instance of this class
+      */
+    static int LuaFunction(lua_State* L)
+    {
+        return Invoke(L,lua_touserdata(L,lua_upvalueindex(1)));
+    }
+
+    static int Invoke(lua_State* L, void* def)
+    {
+        const overload_def* self = static_cast<const overload_def*>(def);
+        const detail::overload_entry* best = nullptr;
+        int best_score = -1;
+        int top = lua_gettop(L);
+        if(top <= self->max_nargs)
+            pick(L,self,self->buckets[top],self->buckets[top + 1],best,best_score);
+        if(best == nullptr)
+            pick(L,self,self->buckets[self->max_nargs + 1],self->count,best,best_score);
+        if(best == nullptr)
+            return no_match(L,self);
+        return best->invoke(L,best->def);
+    }
+
+private:
+    static int sort_key(const detail::overload_entry& entry)
+    {
+        return entry.nargs < 0 ? std::numeric_limits<int>::max() : entry.nargs;
+    }
+
+    //the best scoring of entries[begin] up to entries[end], if it beats best_score
+    static void pick(lua_State* L, const overload_def* self, size_t begin, size_t end,
+                     const detail::overload_entry*& best, int& best_score)
+    {
+        for(size_t i = begin; i < end; ++i)
+        {
+            const detail::overload_entry& entry = self->entries[i];
+            if((entry.first_types & detail::LuaTypeBit(lua_type(L,entry.first_arg))) == 0)
+                continue;
+            int score = entry.score(L);
+            if(score > best_score)
+            {
+                best = &entry;
+                best_score = score;
+            }
+        }
+    }
+
+    static int no_match(lua_State* L, const overload_def* self)
+    {
+        int top = lua_gettop(L);
+        lua_pushstring(L,"");
+        for(int i = 1; i <= top; ++i)
+        {
+            lua_pushstring(L,i > 1 ? ", " : "");
+            lua_pushstring(L,luaL_typename(L,i));
+            lua_concat(L,3);
+        }
+        return luaL_error(L,"no overload of %s takes (%s)",self->name,lua_tostring(L,-1));
+    }
+};
+
+}
@@ -5,16 +5,31 @@
  */
 #include <type_traits>
 #include "return_gc.h"
+#include "unchecked_args.h"
 
 namespace cglb {
 
-template<typename ReturnGC = return_gc<std::false_type>>
+template<typename ReturnGC = return_gc<std::false_type>
+        , typename Args = unchecked_args<std::false_type>>
 struct policy
 {
     static const bool ShouldGC = ReturnGC::should_gc;
+    static const bool UncheckedArgs = Args::unchecked;
 };
 
 typedef policy<return_gc<std::true_type>> policy_return_gc;
 typedef policy<return_gc<std::false_type>> policy_return_nogc;
+typedef policy<return_gc<std::false_type>,unchecked_args<std::true_type>> policy_unchecked_args;
+
+
+template<typename T>
+struct is_policy : public std::false_type
+{
+};
+
+template<typename ReturnGC, typename Args>
+struct is_policy<policy<ReturnGC,Args>> : public std::true_type
+{
+};
 
 }
@@ -0,0 +1,37 @@
+#pragma once
+/* 
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT 
+ */
+#include <type_traits>
+
+namespace cglb {
+
+
+/**
+ * With unchecked_args<std::true_type>, numbers, booleans, enums and strings are read
+ * from the stack with lua_to* instead of luaL_check*, so an argument of the wrong type
+ * becomes 0, false or "" instead of raising an error. Arguments of class types are
+ * still checked. Only meant for functions which are called from trusted scripts.
+ */
+template<typename T>
+struct unchecked_args
+{
+};
+
+
+
+
+template<>
+struct unchecked_args<std::true_type>
+{
+    static const bool unchecked = true;
+};
+
+template<>
+struct unchecked_args<std::false_type>
+{
+    static const bool unchecked = false;
+};
+
+}
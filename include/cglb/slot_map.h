@@ -0,0 +1,160 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "object_holder.h"
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+namespace cglb {
+namespace detail {
+
+
+/**
+ * The objects of one type in one lua_State which are pushed as handles. A userdata
+ * holds a slot and the generation of the slot when it was pushed, and the object is
+ * only given back while the generation still matches, so an object which C++ has
+ * invalidated fails the check instead of dangling.
+ *
+ * A slot is kept as long as a userdata refers to it, and is reused after that with
+ * a new generation.
+ *
+ * Like storage_pool, it is owned by a type_context which calls orphan rather than
+ * delete, and lives on until the last userdata referring to it is collected.
+ */
+class slot_map
+{
+public:
+    slot_map() :
+        free_head(no_slot), refs(0), orphaned(false)
+    {
+    }
+
+    /**
+     * Returns the slot of obj, adding it if it is not in the map, and counts one more
+     * userdata referring to that slot.
+     */
+    uint32_t acquire(void* obj, uint32_t& generation)
+    {
+        uint32_t index;
+        auto itr = lookup.find(obj);
+        if(itr != lookup.end())
+        {
+            index = itr->second;
+        }
+        else if(free_head != no_slot)
+        {
+            index = free_head;
+            free_head = slots[index].next_free;
+            slots[index].obj = obj;
+            lookup[obj] = index;
+        }
+        else
+        {
+            index = (uint32_t)slots.size();
+            slot s;
+            s.obj = obj;
+            s.generation = 0;
+            s.next_free = no_slot;
+            s.refs = 0;
+            slots.push_back(s);
+            lookup[obj] = index;
+        }
+        ++slots[index].refs;
+        ++refs;
+        generation = slots[index].generation;
+        return index;
+    }
+
+    /**
+     * The object in the slot, or nullptr if it was invalidated since generation
+     */
+    void* get(uint32_t index, uint32_t generation) const
+    {
+        slot const& s = slots[index];
+        return s.generation == generation ? s.obj : nullptr;
+    }
+
+    /**
+     * Makes every handle to obj fail from now on. Returns false if obj was not in the map.
+     */
+    bool invalidate(void* obj)
+    {
+        auto itr = lookup.find(obj);
+        if(itr == lookup.end())
+            return false;
+        kill(itr->second);
+        return true;
+    }
+
+    /**
+     * Called when a userdata referring to the slot is collected
+     */
+    void release(uint32_t index)
+    {
+        slot& s = slots[index];
+        if(--s.refs == 0)
+        {
+            if(s.obj != nullptr)
+                kill(index);
+            s.next_free = free_head;
+            free_head = index;
+        }
+        if(--refs == 0 && orphaned)
+            delete this;
+    }
+
+    void orphan()
+    {
+        orphaned = true;
+        if(refs == 0)
+            delete this;
+    }
+
+private:
+    static const uint32_t no_slot = 0xFFFFFFFF;
+
+    struct slot
+    {
+        void* obj;
+        uint32_t generation;
+        uint32_t next_free;
+        uint32_t refs;
+    };
+
+    void kill(uint32_t index)
+    {
+        slot& s = slots[index];
+        lookup.erase(s.obj);
+        s.obj = nullptr;
+        ++s.generation;
+    }
+
+    std::vector<slot> slots;
+    std::unordered_map<void*,uint32_t> lookup;
+    uint32_t free_head;
+    size_t refs;
+    bool orphaned;
+
+    slot_map(slot_map const&);
+    slot_map& operator=(slot_map const&);
+};
+
+
+/**
+ * Layout of a userdata block with handle storage. header.obj is only used to
+ * compare against (for the identity cache), and is never followed without
+ * asking the map first.
+ */
+struct handle_holder
+{
+    object_holder header;
+    slot_map* map;
+    uint32_t slot;
+    uint32_t generation;
+};
+
+}
+}
@@ -0,0 +1,265 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "lua_include.h"
+#include "storage_pool.h"
+#include "slot_map.h"
+#include "async_executor.h"
+#include <vector>
+#include <string>
+#include <atomic>
+#include <new>
+#include <cstring>
+
+namespace cglb {
+
+
+/**
+ * What __newindex does with a key which is not a member of the type. See
+ * class_luadef<T>::unknown_keys.
+ */
+enum unknown_key_policy
+{
+    unknown_keys_ignore,        //the assignment is dropped
+    unknown_keys_error,         //raises a Lua error
+    unknown_keys_property_bag,  //kept in a table for the object, which __index also looks in
+    unknown_keys_custom         //calls the lua_CFunction given to unknown_keys
+};
+
+
+namespace detail {
+
+
+/**
+ * Every type which is defined through class_luadef gets a small integer id,
+ * used to find its type_context in a state_context.
+ */
+inline unsigned next_type_id()
+{
+    static std::atomic<unsigned> next(0);
+    return next++;
+}
+
+template<typename T>
+struct type_id
+{
+    static unsigned get()
+    {
+        static const unsigned id = next_type_id();
+        return id;
+    }
+};
+
+
+/**
+ * What a lua_State knows about one type defined by class_luadef<T>. The refs are
+ * references in to the registry of the state made with luaL_ref.
+ */
+struct type_context
+{
+    type_context() :
+        metatable_ref(LUA_NOREF), identity_cache_ref(LUA_NOREF), property_bags_ref(LUA_NOREF),
+        unknown_keys(unknown_keys_ignore), unknown_key_hook(nullptr),
+        inline_values(false), sealed(false), pool(nullptr), handles(nullptr)
+    {
+    }
+
+    ~type_context()
+    {
+        if(pool != nullptr)
+            pool->orphan();
+        if(handles != nullptr)
+            handles->orphan();
+    }
+
+    std::string class_name;
+    std::string mt_name;      //class_name appended with "_mt"
+
+    int metatable_ref;
+    int identity_cache_ref;   //LUA_NOREF unless class_luadef<T>::identity_cache() was used
+    int property_bags_ref;    //LUA_NOREF unless unknown_keys is unknown_keys_property_bag
+
+    unknown_key_policy unknown_keys;    //set by class_luadef<T>::unknown_keys()
+    lua_CFunction unknown_key_hook;     //for unknown_keys_custom
+
+    bool inline_values;       //set by class_luadef<T>::store_values_inline()
+    bool sealed;              //set by class_luadef<T>::seal()
+    storage_pool* pool;       //set by class_luadef<T>::use_pool()
+    slot_map* handles;        //set by class_luadef<T>::use_handles()
+
+    std::vector<unsigned> derived;  //type ids of the types which inherit from this one
+};
+
+
+/**
+ * The metamethods which every type gets for itself, and which are not inherited,
+ * since they refer to the type's own tables (or construct and destroy the type)
+ */
+inline bool is_own_metamethod(const char* key)
+{
+    static const char* const own[] = {
+        "__index", "__newindex", "__gc", "__metatable", "__tostring", "__init"
+    };
+    for(const char* name : own)
+    {
+        if(std::strcmp(key,name) == 0)
+            return true;
+    }
+    return false;
+}
+
+
+/**
+ * All of the data CGLB keeps for a lua_State. It lives in a userdata in the registry
+ * of the state, so it is destroyed by lua_close, and states never share any of it.
+ *
+ * The deleter of a type is not in here, since __gc of an object may run after this
+ * is destroyed during lua_close. It is an upvalue of the __gc metamethod instead.
+ */
+struct state_context
+{
+    state_context() : executor(nullptr)
+    {
+    }
+
+    ~state_context()
+    {
+        if(executor != nullptr)
+            executor->cancel(this);
+        for(type_context* tc : types)
+        {
+            delete tc;
+        }
+    }
+
+    /**
+     * Returns the context of the type with the given id, or nullptr if that type
+     * has not been defined in this state.
+     */
+    type_context* type(unsigned id) const
+    {
+        return id < types.size() ? types[id] : nullptr;
+    }
+
+    type_context* add_type(unsigned id)
+    {
+        if(id >= types.size())
+            types.resize(id + 1, nullptr);
+        if(types[id] == nullptr)
+            types[id] = new type_context();
+        return types[id];
+    }
+
+    /**
+     * Returns the context of L, or nullptr if nothing has been defined in L yet
+     */
+    static state_context* get(lua_State* L)
+    {
+        lua_pushlightuserdata(L,registry_key());                //[1] = key
+        lua_rawget(L,LUA_REGISTRYINDEX);                        //[1] = registry[key]
+        state_context* ctx = static_cast<state_context*>(lua_touserdata(L,-1));
+        lua_pop(L,1);                                           //pop[1]
+        return ctx;
+    }
+
+    /**
+     * Sets key in the metatable of tc to the value at validx, and also in the types which
+     * inherit from it (and so on down), unless they have their own value for key. A type
+     * which inherited a member still has the same value as its parent, which is how the
+     * two are told apart. This is what keeps derived types flattened when a member is
+     * added to a parent after inherit.
+     *
+     * Raises a Lua error if one of the types which would change is sealed.
+     */
+    void set_member(lua_State* L, type_context* tc, const char* key, int validx)
+    {
+        if(validx < 0 && validx > LUA_REGISTRYINDEX)
+            validx = lua_gettop(L) + validx + 1;
+        if(tc->sealed)
+            luaL_error(L,"%s is sealed in this lua_State",tc->class_name.c_str());
+
+        lua_rawgeti(L,LUA_REGISTRYINDEX,tc->metatable_ref);     //[1] = metatable
+        int mtidx = lua_gettop(L);
+        lua_pushstring(L,key);                                  //[2] = key
+        lua_rawget(L,mtidx);                                    //[2] = old value
+        int oldidx = lua_gettop(L);
+        lua_pushstring(L,key);                                  //[3] = key
+        lua_pushvalue(L,validx);                                //[4] = value
+        lua_rawset(L,mtidx);                                    //[1][key] = value          -> pop[4,3]
+
+        if(!is_own_metamethod(key))
+        {
+            for(unsigned id : tc->derived)
+            {
+                type_context* d = type(id);
+                if(d == nullptr)
+                    continue;
+                lua_rawgeti(L,LUA_REGISTRYINDEX,d->metatable_ref);  //[3] = derived metatable
+                lua_pushstring(L,key);                          //[4] = key
+                lua_rawget(L,-2);                               //[4] = [3][key]
+                bool inherited = lua_isnil(L,-1) || lua_rawequal(L,-1,oldidx);
+                lua_pop(L,2);                                   //pop[4,3]
+                if(inherited)
+                    set_member(L,d,key,validx);
+            }
+        }
+        lua_settop(L,mtidx-1);                                  //pop[2,1]
+    }
+
+    static state_context* get_or_create(lua_State* L)
+    {
+        state_context* ctx = get(L);
+        if(ctx != nullptr)
+            return ctx;
+
+        lua_pushlightuserdata(L,registry_key());                //[1] = key
+        void* block = lua_newuserdata(L,sizeof(state_context)); //[2] = userdata
+        ctx = new (block) state_context();
+        lua_createtable(L,0,1);                                 //[3] = metatable
+        lua_pushcfunction(L,gc_metamethod);                     //[4] = gc_metamethod
+        lua_setfield(L,-2,"__gc");                              //[3].__gc = [4]            -> pop[4]
+        lua_setmetatable(L,-2);                                 //setmetatable([2],[3])     -> pop[3]
+        lua_rawset(L,LUA_REGISTRYINDEX);                        //registry[key] = [2]       -> pop[2,1]
+        return ctx;
+    }
+
+    async_executor* executor;   //set by set_executor
+
+private:
+    std::vector<type_context*> types;  //indexed by type_id<T>::get()
+
+    static void* registry_key()
+    {
+        static char key = 0;
+        return &key;
+    }
+
+    static int gc_metamethod(lua_State* L)
+    {
+        state_context* ctx = static_cast<state_context*>(lua_touserdata(L,1));
+        if(ctx != nullptr)
+            ctx->~state_context();
+        return 0;
+    }
+};
+
+}
+
+
+/**
+ * Sets the executor which resumes the coroutines of L that yield in a call returning a
+ * std::future, or nullptr to have those calls wait instead. See async_executor.h. The
+ * executor must outlive L, or be unset first. The coroutines which are still waiting in
+ * the executor which is replaced are dropped from it, and are never resumed.
+ */
+inline void set_executor(lua_State* L, async_executor* executor)
+{
+    detail::state_context* ctx = detail::state_context::get_or_create(L);
+    if(ctx->executor != nullptr && ctx->executor != executor)
+        ctx->executor->cancel(ctx);
+    ctx->executor = executor;
+}
+
+}
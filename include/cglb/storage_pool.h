@@ -0,0 +1,138 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include "object_holder.h"
+#include <vector>
+#include <new>
+#include <cstddef>
+
+namespace cglb {
+namespace detail {
+
+
+/**
+ * A free list of fixed size blocks for the objects of one type in one lua_State.
+ * Blocks are carved out of chunks, and are reused once the object in them is
+ * garbage collected, so creating and dropping objects does not touch the heap
+ * after the pool has warmed up.
+ *
+ * Each block starts with a pointer to its pool, so deallocate only needs the object.
+ *
+ * A pool is used by one lua_State, so it is not thread safe. It is owned by the
+ * type_context of the state, which calls orphan when it is destroyed. Since objects
+ * can be collected after that during lua_close, the pool then stays alive until the
+ * last of its blocks is given back.
+ */
+class storage_pool
+{
+public:
+    storage_pool(size_t object_size, size_t blocks_per_chunk) :
+        block_size(header_size() + round_up(object_size < sizeof(void*) ? sizeof(void*) : object_size)),
+        chunk_blocks(blocks_per_chunk == 0 ? 1 : blocks_per_chunk),
+        free_list(nullptr), live(0), orphaned(false)
+    {
+    }
+
+    /**
+     * Returns uninitialized memory for one object
+     */
+    void* allocate()
+    {
+        if(free_list == nullptr)
+            grow();
+        void* obj = free_list;
+        free_list = *static_cast<void**>(obj);
+        ++live;
+        return obj;
+    }
+
+    /**
+     * Gives the memory of obj back to the pool it came from. The object must
+     * already be destroyed.
+     */
+    static void deallocate(void* obj)
+    {
+        storage_pool* pool = *reinterpret_cast<storage_pool**>(static_cast<char*>(obj) - header_size());
+        *static_cast<void**>(obj) = pool->free_list;
+        pool->free_list = obj;
+        --pool->live;
+        if(pool->orphaned && pool->live == 0)
+            delete pool;
+    }
+
+    /**
+     * Called by the owner of the pool instead of delete
+     */
+    void orphan()
+    {
+        orphaned = true;
+        if(live == 0)
+            delete this;
+    }
+
+    size_t live_objects() const
+    {
+        return live;
+    }
+
+private:
+    ~storage_pool()
+    {
+        for(char* chunk : chunks)
+        {
+            ::operator delete(chunk);
+        }
+    }
+
+    //enough to keep the object after the header as aligned as a Lua userdata
+    static size_t round_up(size_t size)
+    {
+        const size_t align = std::alignment_of<lua_user_alignment>::value;
+        return (size + align - 1) / align * align;
+    }
+
+    static size_t header_size()
+    {
+        return round_up(sizeof(storage_pool*));
+    }
+
+    void grow()
+    {
+        char* chunk = static_cast<char*>(::operator new(block_size * chunk_blocks));
+        chunks.push_back(chunk);
+        for(size_t i = chunk_blocks; i-- > 0;)
+        {
+            char* block = chunk + i * block_size;
+            *reinterpret_cast<storage_pool**>(block) = this;
+            void* obj = block + header_size();
+            *static_cast<void**>(obj) = free_list;
+            free_list = obj;
+        }
+    }
+
+    size_t block_size;
+    size_t chunk_blocks;
+    void* free_list;
+    size_t live;
+    bool orphaned;
+    std::vector<char*> chunks;
+
+    storage_pool(storage_pool const&);
+    storage_pool& operator=(storage_pool const&);
+};
+
+
+/**
+ * Types which need more alignment than a Lua userdata cannot be pooled, and are
+ * allocated with new instead.
+ */
+template<typename T>
+struct can_pool : public std::integral_constant<bool,
+    std::alignment_of<T>::value <= std::alignment_of<lua_user_alignment>::value>
+{
+};
+
+}
+}
@@ -0,0 +1,101 @@
+#pragma once
+/*
+ * Copyright (c) 2013 Nathan Starkey MIT License
+ * See either the LICENSE file in the repo, or http://opensource.org/licenses/MIT
+ */
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <type_traits>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#define CGLB_HAS_STRING_VIEW 1
+#else
+#define CGLB_HAS_STRING_VIEW 0
+#endif
+
+namespace cglb {
+
+
+/**
+ * A pointer and length in to a string which is not copied. As a function argument,
+ * it points in to the Lua string, which stays valid for the whole call, and the
+ * length keeps any embedded '\0's. The same as std::string_view, which is also
+ * accepted when compiling as C++17.
+ */
+class string_ref
+{
+public:
+    string_ref() : ptr(""), len(0)
+    {
+    }
+
+    string_ref(const char* str) : ptr(str), len(std::strlen(str))
+    {
+    }
+
+    string_ref(const char* str, std::size_t length) : ptr(str), len(length)
+    {
+    }
+
+    string_ref(const std::string& str) : ptr(str.data()), len(str.size())
+    {
+    }
+
+    const char* data() const
+    {
+        return ptr;
+    }
+
+    std::size_t size() const
+    {
+        return len;
+    }
+
+    bool empty() const
+    {
+        return len == 0;
+    }
+
+    std::string str() const
+    {
+        return std::string(ptr,len);
+    }
+
+    bool operator==(const string_ref& other) const
+    {
+        return len == other.len && std::memcmp(ptr,other.ptr,len) == 0;
+    }
+
+    bool operator!=(const string_ref& other) const
+    {
+        return !(*this == other);
+    }
+
+private:
+    const char* ptr;
+    std::size_t len;
+};
+
+
+namespace detail {
+
+
+/**
+ * The class types which are Lua strings rather than objects. They are all made from
+ * a pointer and a length, and have data() and size().
+ */
+template<typename T>
+struct is_string_class : public std::false_type
+{
+};
+
+template<> struct is_string_class<std::string> : public std::true_type {};
+template<> struct is_string_class<string_ref>  : public std::true_type {};
+#if CGLB_HAS_STRING_VIEW
+template<> struct is_string_class<std::string_view> : public std::true_type {};
+#endif
+
+}
+}
@@ -1,8 +1,18 @@
 #include "Test.h"
 #include <cglb/class_luadef.h>
+#include <cglb/module_luadef.h>
 #include <cglb/lua_include.h>
+#include <cglb/allocator.h>
 #include <fstream>
 #include <vector>
+#include <tuple>
+#include <array>
+#include <memory>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <thread>
+#include <chrono>
 #include <iostream>
 #include "stl/lua_stl.h"
 #include "stl/lua_stl_vector.h"
@@ -68,6 +78,345 @@ struct TStruct
     double mdat;
 };
 
+struct InlineStruct
+{
+    int a;
+};
+
+struct CachedStruct
+{
+    CachedStruct(double x) : v(x){}
+    InlineStruct Value()
+    {
+        InlineStruct ret;
+        ret.a = 9;
+        return ret;
+    }
+    double v;
+};
+
+struct SealedStruct
+{
+    SealedStruct(double x) : mdat(x){}
+    bool Add(double x)
+    {
+        mdat += x;
+        return true;
+    }
+    double mdat;
+};
+
+struct TagBase
+{
+    TagBase() : b(5){}
+    int GetB()
+    {
+        return b;
+    }
+    int b;
+};
+
+struct TagPadding
+{
+    double pad;
+};
+
+//TagBase is not the first base, so a TagDerived* needs to be adjusted to be a TagBase*
+struct TagDerived : public TagPadding, public TagBase
+{
+};
+
+//inherit<TagBase> is a compile error for a virtual base
+struct TagVirtual : public virtual TagBase
+{
+};
+static_assert(detail::is_offset_base<TagBase,TagDerived>::value
+           && !detail::is_offset_base<TagBase,TagVirtual>::value, "virtual bases have no fixed offset");
+
+struct LevelA
+{
+    LevelA() : a(1), late(2)
+    {
+    }
+    int GetA()
+    {
+        return a;
+    }
+    int a;
+    int late;
+};
+
+struct LevelB : public LevelA
+{
+    LevelB() : b(10)
+    {
+    }
+    int b;
+};
+
+//three levels deep, and LevelB is not the first base
+struct LevelC : public TagPadding, public LevelB
+{
+    int GetC()
+    {
+        return a + b;
+    }
+};
+
+struct PoolStruct
+{
+    PoolStruct(int v) : value(v)
+    {
+        ++alive;
+    }
+    PoolStruct(PoolStruct const& copy) : value(copy.value)
+    {
+        ++alive;
+    }
+    ~PoolStruct()
+    {
+        --alive;
+    }
+    int value;
+    static int alive;
+};
+int PoolStruct::alive = 0;
+
+struct HandleStruct
+{
+    HandleStruct() : v(3)
+    {
+        ++alive;
+    }
+    ~HandleStruct()
+    {
+        --alive;
+    }
+    int Get()
+    {
+        return v;
+    }
+    int v;
+    static int alive;
+};
+int HandleStruct::alive = 0;
+
+struct KeyStruct
+{
+    KeyStruct() : v(0)
+    {
+    }
+    int GetV()
+    {
+        return v;
+    }
+    void SetV(int x)
+    {
+        v = x;
+    }
+    int v;
+    static int unknown_calls;
+};
+int KeyStruct::unknown_calls = 0;
+
+int CountUnknownKey(lua_State* L)
+{
+    ++KeyStruct::unknown_calls;
+    return 0;
+}
+
+enum FieldColor { field_red = 1, field_green = 2 };
+
+struct FieldStruct
+{
+    FieldStruct() : flag(false), small(0), count(0), ratio(0.0f), big(0), color(field_red), fixed(9)
+    {
+    }
+    bool flag;
+    unsigned char small;
+    int count;
+    float ratio;
+    long long big;
+    FieldColor color;
+    const int fixed;
+};
+
+struct Int64Struct
+{
+    Int64Struct() : id(0)
+    {
+    }
+    unsigned long long Next(unsigned long long v) const
+    {
+        return v + 1;
+    }
+    long long Negate(long long v) const
+    {
+        return -v;
+    }
+    unsigned long long id;
+};
+
+struct UncheckedStruct
+{
+    double Sum(int a, double b, bool c, const std::string& s) const
+    {
+        return a + b + (c ? 1 : 0) + s.size();
+    }
+};
+
+struct StringStruct
+{
+    int Length(cglb::string_ref str) const
+    {
+        return (int)str.size();
+    }
+    std::string Echo(const std::string& str) const
+    {
+        return str + str;
+    }
+};
+
+struct MoveStruct
+{
+    MoveStruct() : v(0)
+    {
+    }
+    MoveStruct(const MoveStruct& other) : v(other.v)
+    {
+        ++copies;
+    }
+    MoveStruct(MoveStruct&& other) : v(other.v)
+    {
+    }
+    int v;
+    static int copies;
+};
+int MoveStruct::copies = 0;
+
+struct Forwarder
+{
+    MoveStruct Bump(MoveStruct m, const MoveStruct& by, int times) const
+    {
+        m.v += by.v * times;
+        return m;
+    }
+};
+
+struct OverloadStruct
+{
+    int Pick() const
+    {
+        return 0;
+    }
+    int Pick(int) const
+    {
+        return 1;
+    }
+    int Pick(const char*) const
+    {
+        return 2;
+    }
+    int Pick(bool) const
+    {
+        return 3;
+    }
+    int Pick(TStruct*) const
+    {
+        return 4;
+    }
+    int Pick(int, int) const
+    {
+        return 5;
+    }
+    int Pick(double) const
+    {
+        return 6;
+    }
+};
+
+//reads its own arguments, so it fits any call of OverloadStruct::PickAny
+int PickAnything(lua_State* L)
+{
+    lua_pushinteger(L,9);
+    return 1;
+}
+
+struct PositionStruct
+{
+    std::tuple<float,float,float> GetPosition() const
+    {
+        return std::make_tuple(1.0f,2.0f,3.0f);
+    }
+    std::pair<std::string,int> GetNamed() const
+    {
+        return std::make_pair(std::string("pos"),4);
+    }
+};
+
+struct BatchStruct
+{
+    double Sum(const std::vector<double>& values) const
+    {
+        double sum = 0;
+        for(double v : values)
+            sum += v;
+        return sum;
+    }
+    std::vector<int> Range(int n) const
+    {
+        std::vector<int> out;
+        for(int i = 1; i <= n; ++i)
+            out.push_back(i);
+        return out;
+    }
+    std::array<float,3> Scale(std::array<float,3> v, float by) const
+    {
+        for(float& f : v)
+            f *= by;
+        return v;
+    }
+    std::vector<std::string> Reverse(std::vector<std::string> names) const
+    {
+        return std::vector<std::string>(names.rbegin(),names.rend());
+    }
+    size_t Length(std::vector<const char*> names) const
+    {
+        size_t len = 0;
+        for(const char* name : names)
+            len += std::strlen(name);
+        return len;
+    }
+};
+
+struct CallableStruct
+{
+    CallableStruct() : v(5)
+    {
+    }
+    int v;
+};
+
+//not defined with class_luadef, only its members through OwnedStruct
+struct UnboundBase
+{
+    UnboundBase() : x(42)
+    {
+    }
+    int Get() { return x; }
+    int x;
+};
+
+struct OwnedStruct : public TagPadding, public UnboundBase
+{
+};
+
+struct NamedStruct
+{
+    int A() { return 1; }
+    int B() { return 2; }
+};
+
 struct NonCopyStruct
 {
     int s;
@@ -83,6 +432,30 @@ bool TestMemberData(lua_State* L);
 bool TestNonRegisteredMemberFunction(lua_State* L);
 bool TestNonRegisteredMemberData(lua_State* L);
 bool TestConstructor(lua_State* L);
+bool TestInlineValue(lua_State* L);
+bool TestRelease(lua_State* L);
+bool TestIdentityCache(lua_State* L);
+bool TestSeparateStates(lua_State* L);
+bool TestTypeCheck(lua_State* L);
+bool TestInheritance(lua_State* L);
+bool TestInheritedMembers(lua_State* L);
+bool TestPool(lua_State* L);
+bool TestAllocator();
+bool TestCallables();
+bool TestModules(lua_State* L);
+bool TestAsync(lua_State* L);
+bool TestPushRange(lua_State* L);
+bool TestHandles(lua_State* L);
+bool TestSeal(lua_State* L);
+bool TestFields(lua_State* L);
+bool TestUnknownKeys(lua_State* L);
+bool TestInt64(lua_State* L);
+bool TestUncheckedArgs(lua_State* L);
+bool TestStrings(lua_State* L);
+bool TestForwarding(lua_State* L);
+bool TestOverloads(lua_State* L);
+bool TestTupleResults(lua_State* L);
+bool TestTables(lua_State* L);
 bool TestVector(lua_State* L);
 bool TestShutdown(lua_State* L);
 
@@ -109,10 +482,58 @@ void TestClass()
         std::cout << "Failed the non registered member data." << std::endl;
     if(!TestConstructor(L))
         std::cout << "Failed constructor. " << std::endl;
+    if(!TestInlineValue(L))
+        std::cout << "Failed inline value. " << std::endl;
+    if(!TestRelease(L))
+        std::cout << "Failed release. " << std::endl;
+    if(!TestIdentityCache(L))
+        std::cout << "Failed identity cache. " << std::endl;
+    if(!TestSeparateStates(L))
+        std::cout << "Failed separate states. " << std::endl;
+    if(!TestTypeCheck(L))
+        std::cout << "Failed type check. " << std::endl;
+    if(!TestInheritance(L))
+        std::cout << "Failed inheritance. " << std::endl;
+    if(!TestInheritedMembers(L))
+        std::cout << "Failed inherited members. " << std::endl;
+    if(!TestPool(L))
+        std::cout << "Failed pool. " << std::endl;
+    if(!TestPushRange(L))
+        std::cout << "Failed push range. " << std::endl;
+    if(!TestHandles(L))
+        std::cout << "Failed handles. " << std::endl;
+    if(!TestSeal(L))
+        std::cout << "Failed seal." << std::endl;
+    if(!TestFields(L))
+        std::cout << "Failed fields." << std::endl;
+    if(!TestUnknownKeys(L))
+        std::cout << "Failed unknown keys." << std::endl;
+    if(!TestInt64(L))
+        std::cout << "Failed 64 bit integers." << std::endl;
+    if(!TestUncheckedArgs(L))
+        std::cout << "Failed unchecked args." << std::endl;
+    if(!TestStrings(L))
+        std::cout << "Failed strings." << std::endl;
+    if(!TestForwarding(L))
+        std::cout << "Failed forwarding." << std::endl;
+    if(!TestOverloads(L))
+        std::cout << "Failed overloads." << std::endl;
+    if(!TestTupleResults(L))
+        std::cout << "Failed tuple results." << std::endl;
+    if(!TestTables(L))
+        std::cout << "Failed tables." << std::endl;
     if(!TestVector(L))
         std::cout << "Failed vector." << std::endl;
+    if(!TestModules(L))
+        std::cout << "Failed modules." << std::endl;
+    if(!TestAsync(L))
+        std::cout << "Failed async." << std::endl;
 
     lua_close(L);
+    if(!TestAllocator())
+        std::cout << "Failed allocator." << std::endl;
+    if(!TestCallables())
+        std::cout << "Failed callables." << std::endl;
     //Want to deallocate the functions AFTER Lua has shutdown
     if(!TestShutdown(L))
         std::cout << "Failed shutdown." << std::endl;
@@ -142,6 +563,23 @@ bool TestRegClasses(lua_State* L)
 
     stl::expose_nonconstvector<float>::type::Expose(L,"VectorFloat");
 
+    //the optional behaviours, each on a type of its own
+    class_luadef<InlineStruct>(L,"InlineStruct")
+        .store_values_inline()
+        .add("a",&InlineStruct::a);
+
+    class_luadef<CachedStruct>(L,"CachedStruct")
+        .add("Value",&CachedStruct::Value)
+        .add("v",&CachedStruct::v)
+        .identity_cache()
+        .constructor<double>();
+
+    class_luadef<SealedStruct>(L,"SealedStruct")
+        .add("Add",&SealedStruct::Add)
+        .add("mdat",&SealedStruct::mdat)
+        .constructor<double>()
+        .seal();
+
     return true;
 }
 
@@ -151,6 +589,30 @@ bool TestShutdown(lua_State* L)
     class_luadef<VecT>::DeallocateLuaDefs();
     class_luadef<TStruct>::DeallocateLuaDefs();
     class_luadef<RetStructTest>::DeallocateLuaDefs();
+    class_luadef<InlineStruct>::DeallocateLuaDefs();
+    class_luadef<CachedStruct>::DeallocateLuaDefs();
+    class_luadef<SealedStruct>::DeallocateLuaDefs();
+    class_luadef<TagBase>::DeallocateLuaDefs();
+    class_luadef<TagDerived>::DeallocateLuaDefs();
+    class_luadef<PoolStruct>::DeallocateLuaDefs();
+    class_luadef<HandleStruct>::DeallocateLuaDefs();
+    class_luadef<FieldStruct>::DeallocateLuaDefs();
+    class_luadef<KeyStruct>::DeallocateLuaDefs();
+    class_luadef<Int64Struct>::DeallocateLuaDefs();
+    class_luadef<UncheckedStruct>::DeallocateLuaDefs();
+    class_luadef<StringStruct>::DeallocateLuaDefs();
+    class_luadef<MoveStruct>::DeallocateLuaDefs();
+    class_luadef<Forwarder>::DeallocateLuaDefs();
+    class_luadef<OverloadStruct>::DeallocateLuaDefs();
+    class_luadef<PositionStruct>::DeallocateLuaDefs();
+    class_luadef<BatchStruct>::DeallocateLuaDefs();
+    class_luadef<CallableStruct>::DeallocateLuaDefs();
+    class_luadef<NamedStruct>::DeallocateLuaDefs();
+    class_luadef<OwnedStruct>::DeallocateLuaDefs();
+    module_luadef::DeallocateLuaDefs();
+    class_luadef<LevelA>::DeallocateLuaDefs();
+    class_luadef<LevelB>::DeallocateLuaDefs();
+    class_luadef<LevelC>::DeallocateLuaDefs();
     return true;
 }
 
@@ -165,6 +627,860 @@ bool TestConstructor(lua_State* L)
     return true;
 }
 
+bool TestInlineValue(lua_State* L)
+{
+    DOLUASTRING("inline_test = CachedStruct(1.0):Value()\n"
+                "inline_test_a = inline_test.a");
+    lua_getglobal(L,"inline_test");
+    InlineStruct* rst = class_luarep<InlineStruct>::check(L,-1);
+    //the object should live inside of the userdata block
+    if(!rst || (void*)rst <= lua_touserdata(L,-1))
+        return false;
+    lua_pop(L,1);
+
+    lua_getglobal(L,"inline_test_a");
+    if(lua_tonumber(L,-1) != 9)
+        return false;
+    lua_pop(L,1);
+    return true;
+}
+
+bool TestRelease(lua_State* L)
+{
+    TStruct* t = new TStruct();
+    class_luarep<TStruct>::push(L,t,true);
+    //an owned object can be given back to C++ only once
+    TStruct* released = class_luarep<TStruct>::release(L,-1);
+    bool ok = released == t && class_luarep<TStruct>::release(L,-1) == NULL;
+    //borrowed objects cannot be released
+    class_luarep<TStruct>::push(L,t,false);
+    ok = ok && class_luarep<TStruct>::release(L,-1) == NULL;
+    lua_pop(L,2);
+    delete t;
+    return ok;
+}
+
+bool TestIdentityCache(lua_State* L)
+{
+    CachedStruct* t = new CachedStruct(1.0);
+    int first = class_luarep<CachedStruct>::push(L,t,false);
+    int second = class_luarep<CachedStruct>::push(L,t,true);
+    bool ok = lua_rawequal(L,first,second) != 0;
+    //the second push made Lua the owner of the shared userdata
+    ok = ok && class_luarep<CachedStruct>::release(L,first) == t;
+    lua_pop(L,2);
+    delete t;
+    return ok;
+}
+
+int EmplaceRStruct(lua_State* L)
+{
+    return class_luarep<RetStructTest>::emplace(L);
+}
+
+bool TestSeparateStates(lua_State* L)
+{
+    //the same type under another name, in a state which is closed first
+    lua_State* L2 = luaL_newstate();
+    luaL_openlibs(L2);
+    class_luadef<TStruct>(L2,"OtherTStruct")
+        .add("mdat",&TStruct::mdat)
+        .constructor<double,int>();
+
+    bool ok = class_luarep<TStruct>::context(L2)->class_name == "OtherTStruct"
+           && class_luarep<TStruct>::context(L)->class_name == "TStruct"
+           && class_luarep<RetStructTest>::context(L2) == nullptr;
+    if(luaL_dostring(L2,"other = OtherTStruct(4.0,1)\n"
+                        "other_mdat = other.mdat") != 0)
+    {
+        Report(L2);
+        ok = false;
+    }
+    lua_getglobal(L2,"other_mdat");
+    ok = ok && lua_tonumber(L2,-1) == 4.0;
+
+    //the identity cache is only made in the state which asked for it
+    class_luadef<CachedStruct>(L2,"CachedStruct")
+        .add("v",&CachedStruct::v);
+    ok = ok && class_luarep<CachedStruct>::context(L2)->identity_cache_ref == LUA_NOREF
+            && class_luarep<CachedStruct>::context(L)->identity_cache_ref != LUA_NOREF;
+
+    //one name bound to a different function in each state
+    NamedStruct named;
+    class_luadef<NamedStruct>(L,"NamedStruct").add("f",&NamedStruct::A);
+    class_luadef<NamedStruct>(L2,"NamedStruct").add("f",&NamedStruct::B);
+    PushGlobalStruct(L,&named,false,"named");
+    PushGlobalStruct(L2,&named,false,"named");
+    DOLUASTRING("named_f = named:f()");
+    if(luaL_dostring(L2,"named_f = named:f()") != 0)
+    {
+        Report(L2);
+        ok = false;
+    }
+    lua_getglobal(L,"named_f");
+    lua_getglobal(L2,"named_f");
+    ok = ok && lua_tonumber(L,-1) == 1 && lua_tonumber(L2,-1) == 2;
+    lua_pop(L,1);
+
+    //RStruct is not defined in L2, and the error names it as it was defined in L
+    lua_pushcfunction(L2,&EmplaceRStruct);
+    ok = ok && lua_pcall(L2,0,1,0) != 0
+            && std::string(lua_tostring(L2,-1)).find("RStruct") != std::string::npos;
+    lua_close(L2);
+
+    //L is not affected by closing L2
+    DOLUASTRING("separate_test = TStruct(2.0,1).mdat");
+    lua_getglobal(L,"separate_test");
+    ok = ok && lua_tonumber(L,-1) == 2.0;
+    lua_pop(L,1);
+    return ok;
+}
+
+bool TestInheritedMembers(lua_State* L)
+{
+    //members of a base which is not defined, bound straight on the derived type
+    class_luadef<OwnedStruct>(L,"OwnedStruct")
+        .add("Get",&OwnedStruct::Get)
+        .add("x",&OwnedStruct::x);
+
+    OwnedStruct* o = new OwnedStruct();
+    PushGlobalStruct(L,o,true,"owned_test");
+    DOLUASTRING("owned_get = owned_test:Get()\n"
+                "owned_x = owned_test.x");
+    lua_getglobal(L,"owned_get");
+    lua_getglobal(L,"owned_x");
+    bool ok = lua_tonumber(L,-2) == 42 && lua_tonumber(L,-1) == 42;
+    lua_pop(L,2);
+    return ok;
+}
+
+bool TestTypeCheck(lua_State* L)
+{
+    class_luadef<TagBase>(L,"TagBase")
+        .add("GetB",&TagBase::GetB)
+        .add_read("b_read",&TagBase::GetB)
+        .add_readonly("b",&TagBase::b);
+    class_luadef<TagDerived>(L,"TagDerived")
+        .inherit<TagBase>();
+
+    TagDerived* d = new TagDerived();
+    int idx = class_luarep<TagDerived>::push(L,d,true);
+    bool ok = class_luarep<TagDerived>::check(L,idx) == d
+           && class_luarep<TagBase>::check(L,idx) == static_cast<TagBase*>(d)
+           && class_luarep<RetStructTest>::check(L,idx) == NULL;
+    lua_setglobal(L,"tag_derived");
+
+    //values which are not from this library
+    lua_pushnumber(L,1.0);
+    lua_newuserdata(L,sizeof(double));
+    ok = ok && class_luarep<TagBase>::check(L,-1) == NULL
+            && class_luarep<TagBase>::check(L,-2) == NULL;
+    lua_pop(L,2);
+
+    //a foreign block which is big enough, and has a 16 bit mark repeated all over it
+    unsigned short* forged = static_cast<unsigned short*>(lua_newuserdata(L,sizeof(detail::object_holder)));
+    for(size_t i = 0; i != sizeof(detail::object_holder) / sizeof(unsigned short); ++i)
+        forged[i] = 0xC6B1;
+    ok = ok && class_luarep<TagBase>::check(L,-1) == NULL;
+    lua_pop(L,1);
+
+    //the TagBase functions and getters are called with the TagBase part of the object
+    DOLUASTRING("tag_b = tag_derived:GetB() + tag_derived.b + tag_derived.b_read");
+    lua_getglobal(L,"tag_b");
+    ok = ok && lua_tonumber(L,-1) == 15;
+    lua_pop(L,1);
+    return ok;
+}
+
+bool TestInheritance(lua_State* L)
+{
+    class_luadef<LevelA>(L,"LevelA")
+        .add("GetA",&LevelA::GetA)
+        .add("a",&LevelA::a);
+    class_luadef<LevelB>(L,"LevelB")
+        .add("b",&LevelB::b)
+        .inherit<LevelA>();
+    class_luadef<LevelC>(L,"LevelC")
+        .add("GetC",&LevelC::GetC)
+        .inherit<LevelB>();
+    //added to the root after the whole hierarchy was defined
+    class_luadef<LevelA>(L,"LevelA")
+        .add("late",&LevelA::late);
+
+    LevelC* c = new LevelC();
+    PushGlobalStruct(L,c,false,"level_c");
+    DOLUASTRING("level_c.a = 3\n"
+                "level_sum = level_c:GetA() + level_c.b + level_c.late + level_c:GetC()");
+    lua_getglobal(L,"level_sum");
+    bool ok = c->a == 3 && lua_tonumber(L,-1) == 3 + 10 + 2 + 13;
+    lua_pop(L,1);
+    DOLUASTRING("level_c = nil");
+    delete c;
+    return ok;
+}
+
+bool TestPool(lua_State* L)
+{
+    class_luadef<PoolStruct>(L,"PoolStruct")
+        .add("value",&PoolStruct::value)
+        .use_pool(true,16)
+        .constructor<int>();
+
+    DOLUASTRING("pool_sum = 0\n"
+                "for i = 1, 100 do pool_sum = pool_sum + PoolStruct(i).value end");
+    lua_getglobal(L,"pool_sum");
+    bool ok = lua_tonumber(L,-1) == 5050;
+    lua_pop(L,1);
+
+    //by value objects come from the same pool, and cannot be released
+    class_luarep<PoolStruct>::emplace(L,PoolStruct(7));
+    ok = ok && class_luarep<PoolStruct>::check(L,-1)->value == 7
+            && class_luarep<PoolStruct>::release(L,-1) == NULL;
+    lua_pop(L,1);
+
+    lua_gc(L,LUA_GCCOLLECT,0);
+    ok = ok && PoolStruct::alive == 0
+            && class_luarep<PoolStruct>::context(L)->pool->live_objects() == 0;
+    return ok;
+}
+
+bool TestPushRange(lua_State* L)
+{
+    std::vector<TStruct*> objs;
+    for(int i = 0; i < 3; ++i)
+    {
+        objs.push_back(new TStruct((double)i,0));
+    }
+    class_luarep<TStruct>::push_range(L,objs.begin(),objs.end());
+    lua_setglobal(L,"range_test");
+
+    std::vector<RetStructTest> values(2);
+    values[0].a = 1;
+    values[1].a = 2;
+    class_luarep<RetStructTest>::emplace_range(L,values.begin(),values.end());
+    lua_setglobal(L,"emplace_range_test");
+
+    DOLUASTRING("range_sum = #range_test + range_test[3].mdat\n"
+                "           + emplace_range_test[1].a + emplace_range_test[2].a");
+    lua_getglobal(L,"range_sum");
+    bool ok = lua_tonumber(L,-1) == 3 + 2 + 1 + 2;
+    lua_pop(L,1);
+
+    DOLUASTRING("range_test = nil");
+    lua_gc(L,LUA_GCCOLLECT,0);
+    for(TStruct* t : objs)
+    {
+        delete t;
+    }
+
+    //the identity cache is shared with single pushes
+    CachedStruct cached(1.0);
+    CachedStruct* cached_ptr = &cached;
+    class_luarep<CachedStruct>::push_range(L,&cached_ptr,&cached_ptr + 1);
+    lua_rawgeti(L,-1,1);
+    class_luarep<CachedStruct>::push(L,&cached);
+    ok = ok && lua_rawequal(L,-1,-2);
+    lua_pop(L,3);
+    //cached is about to go away, so its userdata must not be found again
+    lua_gc(L,LUA_GCCOLLECT,0);
+    return ok;
+}
+
+bool TestHandles(lua_State* L)
+{
+    class_luadef<HandleStruct>(L,"HandleStruct")
+        .use_handles()
+        .add("Get",&HandleStruct::Get);
+
+    HandleStruct* h = new HandleStruct();
+    PushGlobalStruct(L,h,false,"handle_test");
+    DOLUASTRING("handle_before = handle_test:Get()");
+
+    //deleted by C++ while Lua still has it
+    bool ok = class_luarep<HandleStruct>::invalidate(L,h)
+          && !class_luarep<HandleStruct>::invalidate(L,h);
+    delete h;
+    lua_getglobal(L,"handle_test");
+    ok = ok && class_luarep<HandleStruct>::check(L,-1) == NULL;
+    lua_pop(L,1);
+    DOLUASTRING("handle_after = handle_test:Get()");
+    lua_getglobal(L,"handle_before");
+    lua_getglobal(L,"handle_after");
+    ok = ok && lua_tonumber(L,-2) == 3 && lua_isnil(L,-1);
+    lua_pop(L,2);
+
+    //owned handles are deleted on collection like pointers
+    class_luarep<HandleStruct>::push(L,new HandleStruct(),true);
+    lua_pop(L,1);
+    DOLUASTRING("handle_test = nil");
+    lua_gc(L,LUA_GCCOLLECT,0);
+    ok = ok && HandleStruct::alive == 0;
+    return ok;
+}
+
+bool TestFields(lua_State* L)
+{
+    class_luadef<FieldStruct>(L,"FieldStruct")
+        .add("flag",&FieldStruct::flag)
+        .add("small",&FieldStruct::small)
+        .add("count",&FieldStruct::count)
+        .add_writeonly("ratio",&FieldStruct::ratio)
+        .add_readonly("big",&FieldStruct::big)
+        .add("color",&FieldStruct::color)
+        .add_readonly("fixed",&FieldStruct::fixed);
+
+    FieldStruct* f = new FieldStruct();
+    f->big = 1000000;
+    PushGlobalStruct(L,f,false,"field_test");
+    DOLUASTRING("field_test.flag = true\n"
+                "field_test.small = 200\n"
+                "field_test.count = -5\n"
+                "field_test.ratio = 0.5\n"
+                "field_test.color = 2\n"
+                "field_sum = field_test.small + field_test.count + field_test.big\n"
+                "          + field_test.color + field_test.fixed\n"
+                "field_flag = field_test.flag\n"
+                "field_ratio = field_test.ratio");
+    bool ok = f->flag && f->small == 200 && f->count == -5 && f->ratio == 0.5f && f->color == field_green;
+    lua_getglobal(L,"field_sum");
+    lua_getglobal(L,"field_flag");
+    lua_getglobal(L,"field_ratio");
+    ok = ok && lua_tonumber(L,-3) == 200 - 5 + 1000000 + 2 + 9
+            && lua_toboolean(L,-2)
+            && lua_isnil(L,-1);
+    lua_pop(L,3);
+    DOLUASTRING("field_test = nil");
+    delete f;
+    return ok;
+}
+
+bool TestInt64(lua_State* L)
+{
+    class_luadef<Int64Struct>(L,"Int64Struct")
+        .add("id",&Int64Struct::id)
+        .add("Next",&Int64Struct::Next)
+        .add("Negate",&Int64Struct::Negate);
+
+    //neither of these fit in a double
+    const unsigned long long id = (1ULL << 60) + 1;
+    const long long neg = -(1LL << 62) - 3;
+    Int64Struct* s = new Int64Struct();
+    s->id = 1ULL << 52;
+    PushGlobalStruct(L,s,false,"int64_test");
+    //with the default CGLB_INT64_AS_STRING of 0, values a double cannot hold exactly
+    //are errors both ways instead of being rounded
+    DOLUASTRING("int64_next = int64_test:Next(int64_test.id)\n"
+                "int64_test.id = int64_next\n"
+                "int64_errors = 0\n"
+                "if not pcall(function() return int64_test:Next(2^53) end) then int64_errors = int64_errors + 1 end\n"
+                "if not pcall(function() return int64_test:Negate(2^60) end) then int64_errors = int64_errors + 1 end\n"
+                "if not pcall(function() int64_test.id = -1 end) then int64_errors = int64_errors + 1 end");
+    lua_getglobal(L,"int64_next");
+    lua_getglobal(L,"int64_errors");
+    bool ok = s->id == (1ULL << 52) + 1
+           && lua_tonumber(L,-2) == (double)((1ULL << 52) + 1)
+           && lua_tonumber(L,-1) == 3;
+    lua_pop(L,2);
+
+    s->id = id;
+    DOLUASTRING("int64_rounded = pcall(function() return int64_test.id end)");
+    lua_getglobal(L,"int64_rounded");
+    ok = ok && lua_toboolean(L,-1) == 0;
+    lua_pop(L,1);
+
+    //the string form which CGLB_INT64_AS_STRING turns on
+    detail::push_wide_integer(L,id + 1,std::true_type());
+    detail::push_wide_integer(L,neg,std::true_type());
+    detail::push_wide_integer(L,7LL,std::true_type());
+    ok = ok && lua_type(L,-3) == LUA_TSTRING && lua_type(L,-2) == LUA_TSTRING && lua_type(L,-1) == LUA_TNUMBER
+            && detail::check_wide_integer<unsigned long long>(L,-3,std::true_type()) == id + 1
+            && detail::check_wide_integer<long long>(L,-2,std::true_type()) == neg
+            && detail::check_wide_integer<long long>(L,-1,std::true_type()) == 7;
+    lua_pop(L,3);
+    DOLUASTRING("int64_test = nil");
+    delete s;
+    return ok;
+}
+
+bool TestUncheckedArgs(lua_State* L)
+{
+    class_luadef<UncheckedStruct>(L,"UncheckedStruct")
+        .add<policy_unchecked_args>("Sum",&UncheckedStruct::Sum);
+
+    UncheckedStruct* u = new UncheckedStruct();
+    PushGlobalStruct(L,u,false,"unchecked_test");
+    //arguments of the wrong type are 0, false and "" rather than errors
+    DOLUASTRING("unchecked_sum = unchecked_test:Sum(2,0.5,true,'abc')\n"
+                "unchecked_wrong = unchecked_test:Sum(nil,{},nil)");
+    lua_getglobal(L,"unchecked_sum");
+    lua_getglobal(L,"unchecked_wrong");
+    bool ok = lua_tonumber(L,-2) == 6.5 && lua_tonumber(L,-1) == 0;
+    lua_pop(L,2);
+    DOLUASTRING("unchecked_test = nil");
+    delete u;
+    return ok;
+}
+
+bool TestStrings(lua_State* L)
+{
+    class_luadef<StringStruct>(L,"StringStruct")
+        .add("Length",&StringStruct::Length)
+        .add("Echo",&StringStruct::Echo);
+
+    StringStruct* str = new StringStruct();
+    PushGlobalStruct(L,str,false,"string_test");
+    //the embedded '\0's are kept both ways
+    DOLUASTRING("string_len = string_test:Length('a\\0b')\n"
+                "string_echo = string_test:Echo('x\\0y')");
+    lua_getglobal(L,"string_len");
+    lua_getglobal(L,"string_echo");
+    size_t len = 0;
+    const char* echo = lua_tolstring(L,-1,&len);
+    bool ok = lua_tonumber(L,-2) == 3
+           && echo != nullptr && std::string(echo,len) == std::string("x\0yx\0y",6);
+    lua_pop(L,2);
+    DOLUASTRING("string_test = nil");
+    delete str;
+    return ok;
+}
+
+bool TestForwarding(lua_State* L)
+{
+    class_luadef<MoveStruct>(L,"MoveStruct")
+        .constructor<>()
+        .add("v",&MoveStruct::v);
+    class_luadef<Forwarder>(L,"Forwarder")
+        .add("Bump",&Forwarder::Bump);
+
+    Forwarder* fwd = new Forwarder();
+    PushGlobalStruct(L,fwd,false,"forward_test");
+    DOLUASTRING("forward_a = MoveStruct()\n"
+                "forward_a.v = 1\n"
+                "forward_b = MoveStruct()\n"
+                "forward_b.v = 2");
+    MoveStruct::copies = 0;
+    DOLUASTRING("forward_v = forward_test:Bump(forward_a,forward_b,3).v");
+    lua_getglobal(L,"forward_v");
+    //the by value argument is copied out of its userdata once, everything else is moved
+    //or passed by reference
+    bool ok = lua_tonumber(L,-1) == 7 && MoveStruct::copies == 1;
+    lua_pop(L,1);
+    DOLUASTRING("forward_test = nil forward_a = nil forward_b = nil");
+    delete fwd;
+    return ok;
+}
+
+bool TestOverloads(lua_State* L)
+{
+    typedef OverloadStruct O;
+    class_luadef<O>(L,"OverloadStruct")
+        .add("Pick",
+             static_cast<int (O::*)() const>(&O::Pick),
+             static_cast<int (O::*)(double) const>(&O::Pick),
+             static_cast<int (O::*)(int) const>(&O::Pick),
+             static_cast<int (O::*)(const char*) const>(&O::Pick),
+             static_cast<int (O::*)(bool) const>(&O::Pick),
+             static_cast<int (O::*)(TStruct*) const>(&O::Pick),
+             static_cast<int (O::*)(int,int) const>(&O::Pick));
+
+    O* o = new O();
+    PushGlobalStruct(L,o,false,"overload_test");
+    DOLUASTRING("local o = overload_test\n"
+                "overload_picks = o:Pick() .. o:Pick(7) .. o:Pick('a') .. o:Pick(true)\n"
+                "              .. o:Pick(TStruct(4.0,1)) .. o:Pick(1,2) .. o:Pick(nil) .. o:Pick(1.5)");
+    lua_getglobal(L,"overload_picks");
+    const char* picks = lua_tostring(L,-1);
+    //nil only fits the pointer, and a whole number goes to the int even though the
+    //double is first
+    bool ok = picks != nullptr && std::string(picks) == "01234546";
+    lua_pop(L,1);
+
+    //fewer functions under the same name in another state get a def of their own
+    lua_State* L2 = luaL_newstate();
+    class_luadef<O>(L2,"OverloadStruct")
+        .add("Pick",
+             static_cast<int (O::*)(int) const>(&O::Pick),
+             static_cast<int (O::*)(double) const>(&O::Pick));
+    lua_close(L2);
+    DOLUASTRING("overload_picks = overload_test:Pick() .. overload_test:Pick(true)");
+    lua_getglobal(L,"overload_picks");
+    picks = lua_tostring(L,-1);
+    ok = ok && picks != nullptr && std::string(picks) == "03";
+    lua_pop(L,1);
+    ok = ok && luaL_dostring(L,"overload_test:Pick({})") != 0;
+    lua_pop(L,1); //error message
+
+    //a function which reads its own arguments only gets the calls nothing else fits,
+    //even when it is listed first
+    class_luadef<O>(L,"OverloadStruct")
+        .add("PickAny",
+             &PickAnything,
+             static_cast<int (O::*)() const>(&O::Pick),
+             static_cast<int (O::*)(int) const>(&O::Pick));
+    DOLUASTRING("overload_picks = overload_test:PickAny() .. overload_test:PickAny(1) .. overload_test:PickAny('a','b')");
+    lua_getglobal(L,"overload_picks");
+    picks = lua_tostring(L,-1);
+    ok = ok && picks != nullptr && std::string(picks) == "019";
+    lua_pop(L,1);
+
+    //Lua 5.3 and later do not take a fraction for an integer, so no overload fits it
+    class_luadef<O>(L,"OverloadStruct")
+        .add("PickWhole",
+             static_cast<int (O::*)(int) const>(&O::Pick),
+             static_cast<int (O::*)(bool) const>(&O::Pick));
+#if LUA_VERSION_NUM >= 503
+    ok = ok && luaL_dostring(L,"overload_test:PickWhole(1.5)") != 0;
+#else
+    ok = ok && luaL_dostring(L,"overload_picks = overload_test:PickWhole(1.5)") == 0;
+    lua_getglobal(L,"overload_picks");
+    ok = ok && lua_tonumber(L,-1) == 1;
+#endif
+    lua_pop(L,1);
+    DOLUASTRING("overload_test = nil");
+    delete o;
+    return ok;
+}
+
+bool TestTupleResults(lua_State* L)
+{
+    class_luadef<PositionStruct>(L,"PositionStruct")
+        .add("GetPosition",&PositionStruct::GetPosition)
+        .add("GetNamed",&PositionStruct::GetNamed);
+
+    PositionStruct* p = new PositionStruct();
+    PushGlobalStruct(L,p,false,"tuple_test");
+    DOLUASTRING("local x, y, z = tuple_test:GetPosition()\n"
+                "local name, n = tuple_test:GetNamed()\n"
+                "tuple_sum = x + y + z + n\n"
+                "tuple_name = name");
+    lua_getglobal(L,"tuple_sum");
+    lua_getglobal(L,"tuple_name");
+    const char* name = lua_tostring(L,-1);
+    bool ok = lua_tonumber(L,-2) == 10 && name != nullptr && std::string(name) == "pos";
+    lua_pop(L,2);
+    DOLUASTRING("tuple_test = nil");
+    delete p;
+    return ok;
+}
+
+bool TestTables(lua_State* L)
+{
+    class_luadef<BatchStruct>(L,"BatchStruct")
+        .add("Sum",&BatchStruct::Sum)
+        .add("Range",&BatchStruct::Range)
+        .add("Scale",&BatchStruct::Scale)
+        .add("Reverse",&BatchStruct::Reverse)
+        .add("Length",&BatchStruct::Length);
+
+    BatchStruct* b = new BatchStruct();
+    PushGlobalStruct(L,b,false,"table_test");
+    DOLUASTRING("local b = table_test\n"
+                "local range = b:Range(100)\n"
+                "local scaled = b:Scale({1,2,3},2)\n"
+                "local names = b:Reverse({'a','b',3})\n"
+                "table_sum = b:Sum(range) + #range + scaled[1] + scaled[3] + b:Length({'ab','c'})\n"
+                "table_names = table.concat(names)");
+    lua_getglobal(L,"table_sum");
+    lua_getglobal(L,"table_names");
+    const char* names = lua_tostring(L,-1);
+    bool ok = lua_tonumber(L,-2) == 5050 + 100 + 2 + 6 + 3
+           && names != nullptr && std::string(names) == "3ba";
+    lua_pop(L,2);
+    //a number is copied in to a std::string, but a const char* would point in to a
+    //string which is gone by the call
+    ok = ok && luaL_dostring(L,"table_test:Length({'a',2})") != 0;
+    lua_pop(L,1); //error message
+    //std::array needs exactly its size
+    ok = ok && luaL_dostring(L,"table_test:Scale({1,2},2)") != 0;
+    lua_pop(L,1); //error message
+    DOLUASTRING("table_test = nil");
+    delete b;
+    return ok;
+}
+
+bool TestUnknownKeys(lua_State* L)
+{
+    class_luadef<KeyStruct>(L,"KeyStruct")
+        .add_read("value",&KeyStruct::GetV)
+        .add_write("value",&KeyStruct::SetV)
+        .unknown_keys(unknown_keys_property_bag);
+
+    KeyStruct* k = new KeyStruct();
+    PushGlobalStruct(L,k,false,"key_test");
+    DOLUASTRING("key_test.value = 4\n"
+                "key_test.extra = 'bag'\n"
+                "key_value = key_test.value\n"
+                "key_extra = key_test.extra");
+    lua_getglobal(L,"key_value");
+    lua_getglobal(L,"key_extra");
+    bool ok = k->v == 4
+           && lua_tonumber(L,-2) == 4
+           && lua_isstring(L,-1) && std::string(lua_tostring(L,-1)) == "bag";
+    lua_pop(L,2);
+
+    class_luadef<KeyStruct>(L,"KeyStruct")
+        .unknown_keys(unknown_keys_error);
+    ok = ok && luaL_dostring(L,"key_test.other = 1") != 0;
+    lua_settop(L,0);
+
+    class_luadef<KeyStruct>(L,"KeyStruct")
+        .unknown_keys(unknown_keys_custom,&CountUnknownKey);
+    DOLUASTRING("key_test.other = 1\n"
+                "key_test.value = 5");
+    ok = ok && KeyStruct::unknown_calls == 1 && k->v == 5;
+
+    DOLUASTRING("key_test = nil");
+    delete k;
+    return ok;
+}
+
+bool AllowOnce(state_allocator& allocator, size_t in_use, size_t requested, void* userdata)
+{
+    int* calls = static_cast<int*>(userdata);
+    return (*calls)++ == 0;
+}
+
+bool TestSeal(lua_State* L)
+{
+    //SealedStruct is sealed in TestRegClasses, so members and methods come from the hash,
+    //and anything else from the metatable
+    bool ok = class_luarep<SealedStruct>::context(L)->sealed
+           && !class_luarep<TStruct>::context(L)->sealed;
+    DOLUASTRING("local t = SealedStruct(3.0)\n"
+                "seal_test = t.mdat\n"
+                "if type(t.Add) == 'function' then seal_test = seal_test + 1 end\n"
+                "if t.notAMember == nil and t[1] == nil then seal_test = seal_test + 1 end\n"
+                "t.mdat = 7.0\n"
+                "seal_test = seal_test + t.mdat");
+    lua_getglobal(L,"seal_test");
+    ok = ok && lua_tonumber(L,-1) == 3 + 1 + 1 + 7;
+    lua_pop(L,1);
+    return ok;
+}
+
+bool TestCallables()
+{
+    //in its own state, to see the captures destroyed by lua_close
+    std::shared_ptr<int> calls = std::make_shared<int>(0);
+    lua_State* L = luaL_newstate();
+    const int factor = 3;
+    class_luadef<CallableStruct>(L,"CallableStruct")
+        .add("Add",[calls](CallableStruct* self, int n) { ++*calls; return self->v + n; })
+        .add("Scaled",[factor](CallableStruct* self) { return self->v * factor; })
+        .add("Get",std::function<int(CallableStruct*)>([](CallableStruct* self) { return self->v; }));
+
+    CallableStruct* c = new CallableStruct();
+    PushGlobalStruct(L,c,false,"callable_test");
+    DOLUASTRING("callable_sum = callable_test:Add(2) + callable_test:Scaled() + callable_test:Get()");
+    lua_getglobal(L,"callable_sum");
+    bool ok = lua_tonumber(L,-1) == 7 + 15 + 5 && *calls == 1 && calls.use_count() == 2;
+    lua_close(L);
+    ok = ok && calls.use_count() == 1;
+    delete c;
+    return ok;
+}
+
+enum class ModuleShape
+{
+    Circle = 1,
+    Square = 4
+};
+
+int ModuleAdd(int a, int b)
+{
+    return a + b;
+}
+
+std::string ModuleRepeat(const std::string& str, int n)
+{
+    std::string out;
+    for(int i = 0; i < n; ++i)
+        out += str;
+    return out;
+}
+
+int ModuleCount(lua_State* L)
+{
+    lua_pushinteger(L,lua_gettop(L));
+    return 1;
+}
+
+bool TestModules(lua_State* L)
+{
+    const int offset = 10;
+    module_luadef(L,"testmod")
+        .reserve(7)
+        .add("Add",&ModuleAdd)
+        .add("Repeat",&ModuleRepeat)
+        .add("Count",&ModuleCount)
+        .add("Offset",[offset](int v) { return v + offset; })
+        .constant("Scale",2.5)
+        .constant("Name","mod")
+        .add_enum<ModuleShape>("Shape",{{"Circle",ModuleShape::Circle},{"Square",ModuleShape::Square}})
+        .commit();
+
+    //a second batch is added to the same table
+    module_luadef(L,"testmod")
+        .constant("Enabled",true)
+        .constant("Square",ModuleShape::Square)
+        .commit();
+
+    //one which is never committed adds nothing
+    module_luadef(L,"testmod")
+        .add_enum<ModuleShape>("Uncommitted",{{"Circle",ModuleShape::Circle}});
+
+    DOLUASTRING("module_sum = testmod.Add(1,2) + testmod.Count(1,2,3) + testmod.Offset(1)\n"
+                "    + testmod.Scale * 2 + testmod.Shape.Circle + testmod.Shape.Square + testmod.Square\n"
+                "module_str = testmod.Repeat(testmod.Name,2) .. tostring(testmod.Enabled)");
+    lua_getglobal(L,"module_sum");
+    lua_getglobal(L,"module_str");
+    bool ok = lua_tonumber(L,-2) == 3 + 3 + 11 + 5 + 1 + 4 + 4
+           && lua_tostring(L,-1) != nullptr && std::string(lua_tostring(L,-1)) == "modmodtrue";
+    lua_pop(L,2);
+    DOLUASTRING("module_uncommitted = testmod.Uncommitted");
+    lua_getglobal(L,"module_uncommitted");
+    ok = ok && lua_isnil(L,-1);
+    lua_pop(L,1);
+    return ok;
+}
+
+bool TestAsync(lua_State* L)
+{
+    local_executor executor;
+    set_executor(L,&executor);
+    std::promise<int> promise;
+    std::shared_future<int> value = promise.get_future().share();
+    std::promise<int> never;
+    std::shared_future<int> never_value = never.get_future().share();
+    std::promise<int> later;
+    std::shared_future<int> later_value = later.get_future().share();
+    std::promise<int> slow;
+    std::shared_future<int> slow_value = slow.get_future().share();
+    module_luadef(L,"asynctest")
+        .add("Wait",[value]() { return value; })
+        .add("Never",[never_value]() { return never_value; })
+        .add("Later",[later_value]() { return later_value; })
+        .add("Slow",[slow_value]() { return slow_value; })
+        .add("Ready",[]() { std::promise<std::string> p; p.set_value("now"); return p.get_future(); })
+        .commit();
+
+    DOLUASTRING("async_co = coroutine.create(function()\n"
+                "    async_ready = asynctest.Ready()\n"
+                "    async_result = asynctest.Wait() + 1\n"
+                "end)\n"
+                "local _, yielded = coroutine.resume(async_co)\n"
+                "async_yielded = type(yielded)\n"
+                "coroutine.resume(async_co,'early')");
+    lua_getglobal(L,"async_result");
+    lua_getglobal(L,"async_yielded");
+    //yielded in Wait with a userdata, and resuming it early only yields again
+    bool ok = lua_isnil(L,-2) && std::string(lua_tostring(L,-1)) == "userdata"
+           && executor.pending() == 1 && executor.run_ready() == 0;
+    lua_pop(L,2);
+
+    promise.set_value(41);
+    ok = ok && executor.run_ready() == 1 && executor.pending() == 0;
+    lua_getglobal(L,"async_result");
+    lua_getglobal(L,"async_ready");
+    ok = ok && lua_tonumber(L,-2) == 42
+            && lua_tostring(L,-1) != nullptr && std::string(lua_tostring(L,-1)) == "now";
+    lua_pop(L,2);
+
+    //the main thread can't yield, so the call just returns the value
+    DOLUASTRING("async_main = asynctest.Wait()");
+    lua_getglobal(L,"async_main");
+    ok = ok && lua_tonumber(L,-1) == 41;
+    lua_pop(L,1);
+
+    //a coroutine which a script resumes itself once the future is ready is not waiting
+    //any more, so run_ready only releases its task, and does not count it as resumed
+    DOLUASTRING("async_self = coroutine.create(function() async_later = asynctest.Later() end)\n"
+                "coroutine.resume(async_self)");
+    later.set_value(5);
+    DOLUASTRING("coroutine.resume(async_self)");
+    lua_getglobal(L,"async_later");
+    ok = ok && lua_tonumber(L,-1) == 5 && executor.pending() == 1
+            && executor.run_ready() == 0 && executor.pending() == 0;
+    lua_pop(L,1);
+
+    //a call which can't yield (from table.sort) waits for the future from Lua 5.2 on,
+    //and raises an error in Lua 5.1 and LuaJIT. Either way the executor resumes nothing.
+#if LUA_VERSION_NUM >= 502
+    std::thread setter([&slow]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        slow.set_value(3);
+    });
+#endif
+    DOLUASTRING("local co = coroutine.create(function()\n"
+                "    table.sort({1,2},function(a,b) async_slow = asynctest.Slow() return a < b end)\n"
+                "end)\n"
+                "async_sorted = coroutine.resume(co)");
+#if LUA_VERSION_NUM >= 502
+    setter.join();
+#endif
+    lua_getglobal(L,"async_sorted");
+    lua_getglobal(L,"async_slow");
+#if LUA_VERSION_NUM >= 502
+    ok = ok && lua_toboolean(L,-2) != 0 && lua_tonumber(L,-1) == 3;
+#else
+    ok = ok && lua_toboolean(L,-2) == 0 && lua_isnil(L,-1);
+#endif
+    ok = ok && executor.run_ready() == 0 && executor.pending() == 0;
+    lua_pop(L,2);
+
+    //a coroutine dropped by replacing the executor can be collected
+    DOLUASTRING("async_weak = setmetatable({},{__mode = 'k'})\n"
+                "local co = coroutine.create(function() asynctest.Never() end)\n"
+                "async_weak[co] = true\n"
+                "coroutine.resume(co)");
+    ok = ok && executor.pending() == 1;
+    set_executor(L,nullptr);
+    ok = ok && executor.pending() == 0;
+    lua_gc(L,LUA_GCCOLLECT,0);
+    DOLUASTRING("async_collected = next(async_weak) == nil");
+    lua_getglobal(L,"async_collected");
+    ok = ok && lua_toboolean(L,-1) != 0;
+    lua_pop(L,1);
+    return ok;
+}
+
+bool TestAllocator()
+{
+    state_allocator alloc;
+    //used the same way Lua uses it
+    void* small = state_allocator::alloc(&alloc,NULL,0,24);
+    small = state_allocator::alloc(&alloc,small,24,30);  //same size class
+    void* large = state_allocator::alloc(&alloc,NULL,0,1000);
+    bool ok = small != NULL && large != NULL
+           && alloc.stats().bytes == 1030 && alloc.stats().blocks == 2;
+
+    int calls = 0;
+    alloc.set_limit(1100,&AllowOnce,&calls);
+    void* over = state_allocator::alloc(&alloc,NULL,0,100);    //let through by the hook
+    ok = ok && over != NULL
+            && state_allocator::alloc(&alloc,NULL,0,100) == NULL
+            && alloc.stats().limit_failures == 1;
+
+    state_allocator::alloc(&alloc,over,100,0);
+    state_allocator::alloc(&alloc,large,1000,0);
+    state_allocator::alloc(&alloc,small,30,0);
+    ok = ok && alloc.stats().bytes == 0 && alloc.stats().blocks == 0
+            && alloc.stats().peak_bytes == 1130;
+
+    //LuaJIT on x64 without GC64 does not allow a custom allocator
+    alloc.set_limit(0);
+    lua_State* L = alloc.newstate();
+    if(L != NULL)
+    {
+        DOLUASTRING("alloc_test = {} for i = 1, 100 do alloc_test[i] = {i} end");
+        ok = ok && alloc.stats().bytes > 0;
+        lua_close(L);
+        ok = ok && alloc.stats().bytes == 0;
+    }
+    return ok;
+}
+
 template<typename T>
 bool PushGlobalStruct(lua_State* L, T* obj, bool gc, const char* name)
 {